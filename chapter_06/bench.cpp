@@ -0,0 +1,467 @@
+// In-process micro benchmarks for the request path. Requests are fed
+// straight into a connection's rbuf, so no sockets or syscalls are timed.
+//
+//   g++ -O2 -pthread bench.cpp hash.cpp hashtable.cpp swisstable.cpp uring.cpp mpsc_queue.cpp buffer.cpp slab.cpp timer.cpp zset.cpp ../chapter_07/avl.cpp ../chapter_07/btree.cpp -o bench
+//   ./bench get
+//   ./bench engines
+//   ./bench hash
+//   ./bench memory
+//   ./bench mget
+//   ./bench churn
+
+#define main server_main
+#include "server.cpp"
+#undef main
+
+#include <malloc.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <new>
+
+// Every C++ heap allocation goes through here.
+static uint64_t g_allocs = 0;
+
+void* operator new(size_t size)
+{
+    ++g_allocs;
+    void* p = malloc(size > 0 ? size : 1);
+    if (NULL == p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t bench_nsec()
+{
+    struct timespec tv = {};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_nsec;
+}
+
+static std::string bench_req(const std::vector<std::string>& cmd)
+{
+    std::string req;
+    const uint32_t n = (uint32_t)cmd.size();
+    req.append((char*)&n, 4);
+    for (const std::string& arg : cmd) {
+        const uint32_t len = (uint32_t)arg.size();
+        req.append((char*)&len, 4);
+        req.append(arg);
+    }
+
+    std::string framed;
+    const uint32_t len = (uint32_t)req.size();
+    framed.append((char*)&len, HEADER_SIZE);
+    framed.append(req);
+    return framed;
+}
+
+static Connection* bench_connection()
+{
+    Connection* connection = (Connection*)malloc(sizeof(Connection));
+    connection->fd = -1;
+    connection->state = STATE_REQ;
+    connection->pending = 0;
+    connection->replies = NULL;
+    buf_init(&connection->rbuf);
+    buf_init(&connection->wbuf);
+    connection->wbuf_sent = 0;
+    connection->refs = NULL;
+    connection->refs_tail = NULL;
+    connection->ref_bytes = 0;
+    connection->ref_sent = 0;
+    timer_init(&connection->idle_timer, &connection_idle);
+    return connection;
+}
+
+// Runs each framed request once through handle_one_request; the responses
+// are dropped as if they had been sent. Returns the elapsed nanoseconds.
+static uint64_t bench_run(const char* name, Connection* connection, const std::vector<std::string>& reqs)
+{
+    const uint64_t allocs = g_allocs;
+    const uint64_t start = bench_nsec();
+    for (const std::string& req : reqs) {
+        buf_append(&connection->rbuf, req.data(), req.size());
+        const bool ok = handle_one_request(connection);
+        assert(ok);
+        (void)ok;
+        connection_sent(connection, connection->wbuf.size + connection->ref_bytes);
+    }
+    const uint64_t elapsed = bench_nsec() - start;
+    const double n = (double)reqs.size();
+    printf("%-8s %10zu ops %8.1f ns/op %8.3f allocs/op\n",
+           name, reqs.size(), elapsed / n, (g_allocs - allocs) / n);
+    return elapsed;
+}
+
+static void bench_get(const size_t nkeys, const size_t nops)
+{
+    Connection* connection = bench_connection();
+    std::vector<std::string> sets;
+    std::vector<std::string> gets;
+    char key[32];
+    for (size_t i = 0; i < nkeys; ++i) {
+        snprintf(key, sizeof(key), "key:%zu", i);
+        sets.push_back(bench_req({ "set", key, "value" }));
+    }
+    for (size_t i = 0; i < nops; ++i) {
+        snprintf(key, sizeof(key), "key:%zu", (i * 7919) % nkeys);
+        gets.push_back(bench_req({ "get", key }));
+    }
+
+    bench_run("set", connection, sets);
+    // Warm up the scratch space, then measure.
+    bench_run("get", connection, gets);
+    bench_run("get", connection, gets);
+}
+
+// The hash str_hash used before hash_bytes, kept for comparison.
+static uint64_t fnv_hash(const void* data, const size_t len, uint64_t seed)
+{
+    (void)seed;
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h + p[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static void bench_hash_speed(const char* name, uint64_t (*hash)(const void*, size_t, uint64_t))
+{
+    const size_t lens[] = { 8, 16, 32, 64, 256, 4096 };
+    std::vector<uint8_t> data(4096);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t)(i * 131 + 7);
+    }
+    for (size_t len : lens) {
+        const size_t n = (64 << 20) / len;
+        uint64_t sink = 0;
+        const uint64_t start = bench_nsec();
+        for (size_t i = 0; i < n; ++i) {
+            // Each result feeds the next input, so calls cannot overlap.
+            data[0] = (uint8_t)sink;
+            sink += hash(data.data(), len, 0);
+        }
+        const uint64_t elapsed = bench_nsec() - start;
+        printf("%-5s %5zu bytes %8.1f ns/hash %6.2f GB/s  (%llx)\n", name, len,
+               (double)elapsed / n, (double)len * n / elapsed, (unsigned long long)(sink & 0xF));
+    }
+}
+
+static size_t key_seq(char* key, const size_t i)
+{
+    return (size_t)sprintf(key, "key:%zu", i);
+}
+
+static size_t key_padded(char* key, const size_t i)
+{
+    return (size_t)sprintf(key, "user:%012zu", i);
+}
+
+// 16 random-looking hex digits.
+static size_t key_random(char* key, const size_t i)
+{
+    uint64_t x = (i + 1) * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 29;
+    return (size_t)sprintf(key, "%016llx", (unsigned long long)x);
+}
+
+// Bucket occupancy at the chained map's maximum load factor of 8.
+static void bench_hash_chains(const char* name, uint64_t (*hash)(const void*, size_t, uint64_t),
+                              const char* keys, size_t (*make_key)(char*, size_t), const size_t nkeys)
+{
+    size_t nbuckets = 1;
+    while (nbuckets * 8 < nkeys) {
+        nbuckets *= 2;
+    }
+    std::vector<uint64_t> hcodes;
+    std::vector<uint32_t> chains(nbuckets);
+    char key[64];
+    for (size_t i = 0; i < nkeys; ++i) {
+        const uint64_t hcode = hash(key, make_key(key, i), 0x1234);
+        hcodes.push_back(hcode);
+        ++chains[hcode & (nbuckets - 1)];
+    }
+    std::sort(hcodes.begin(), hcodes.end());
+    const size_t distinct = std::unique(hcodes.begin(), hcodes.end()) - hcodes.begin();
+    uint32_t longest = 0;
+    double walked = 0;
+    for (uint32_t len : chains) {
+        longest = len > longest ? len : longest;
+        // A hit walks half its chain on average.
+        walked += (double)len * (len + 1) / 2;
+    }
+    printf("%-5s %-7s %zu keys: %5zu equal hcodes, longest chain %u, %.2f nodes per hit\n",
+           name, keys, nkeys, nkeys - distinct, longest, walked / nkeys);
+}
+
+static void bench_hash()
+{
+    bench_hash_speed("fnv", &fnv_hash);
+    bench_hash_speed("wy", &hash_bytes_seeded);
+    const char* names[] = { "seq", "padded", "random" };
+    size_t (*makers[])(char*, size_t) = { &key_seq, &key_padded, &key_random };
+    for (size_t i = 0; i < 3; ++i) {
+        bench_hash_chains("fnv", &fnv_hash, names[i], makers[i], 4000000);
+        bench_hash_chains("wy", &hash_bytes_seeded, names[i], makers[i], 4000000);
+    }
+}
+
+// Hits and misses against each keyspace engine, at a few table sizes.
+static void bench_engines()
+{
+    const char* names[] = { "chain", "swiss" };
+    const size_t sizes[] = { 10000, 1000000 };
+    for (uint32_t engine = ENGINE_CHAIN; engine <= ENGINE_SWISS; ++engine) {
+        g_config.hash_engine = engine;
+        for (size_t nkeys : sizes) {
+            Connection* connection = bench_connection();
+            std::vector<std::string> sets;
+            std::vector<std::string> hits;
+            std::vector<std::string> misses;
+            char key[64];
+            for (size_t i = 0; i < nkeys; ++i) {
+                snprintf(key, sizeof(key), "%s:%zu:%zu", names[engine], nkeys, i);
+                sets.push_back(bench_req({ "set", key, "value" }));
+            }
+            for (size_t i = 0; i < 1000000; ++i) {
+                snprintf(key, sizeof(key), "%s:%zu:%zu", names[engine], nkeys, (i * 7919) % nkeys);
+                hits.push_back(bench_req({ "get", key }));
+                snprintf(key, sizeof(key), "%s:%zu:%zu", names[engine], nkeys, nkeys + i);
+                misses.push_back(bench_req({ "get", key }));
+            }
+            printf("%s, %zu keys\n", names[engine], nkeys);
+            bench_run("set", connection, sets);
+            bench_run("hit", connection, hits);
+            bench_run("miss", connection, misses);
+        }
+    }
+}
+
+// Per-key cost of MGET at a few batch sizes, in a keyspace far larger than
+// the caches, so most lookups miss.
+static void bench_mget()
+{
+    const size_t nkeys = 4000000;
+    const size_t nlookups = 2000000;
+    const size_t batches[] = { 1, 16, 256 };
+    const char* names[] = { "chain", "swiss" };
+    char key[32];
+    for (uint32_t engine = ENGINE_CHAIN; engine <= ENGINE_SWISS; ++engine) {
+        g_config.hash_engine = engine;
+        Connection* connection = bench_connection();
+        std::vector<std::string> sets;
+        for (size_t i = 0; i < nkeys; ++i) {
+            snprintf(key, sizeof(key), "%s:%zu", names[engine], i);
+            sets.push_back(bench_req({ "set", key, "value" }));
+        }
+        printf("%s, %zu keys\n", names[engine], nkeys);
+        bench_run("set", connection, sets);
+        sets.clear();
+        sets.shrink_to_fit();
+
+        for (const size_t batch : batches) {
+            std::vector<std::string> reqs;
+            std::vector<std::string> cmd;
+            for (size_t i = 0; i < nlookups; ++i) {
+                if (cmd.empty()) {
+                    cmd.push_back("mget");
+                }
+                snprintf(key, sizeof(key), "%s:%zu", names[engine], (i * 7919) % nkeys);
+                cmd.push_back(key);
+                if (cmd.size() == batch + 1) {
+                    reqs.push_back(bench_req(cmd));
+                    cmd.clear();
+                }
+            }
+            char name[16];
+            snprintf(name, sizeof(name), "mget %zu", batch);
+            const uint64_t elapsed = bench_run(name, connection, reqs);
+            printf("%-8s %10zu keys %8.1f ns/key\n", "", nlookups, (double)elapsed / nlookups);
+        }
+    }
+}
+
+static size_t bench_rss()
+{
+    long size = 0;
+    long resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static inline uint64_t bench_rand(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Sets or deletes keys "key:N" for N in [first, last) that `pick` accepts,
+// with values of 1 to `max_value` bytes; prints ns/op and the RSS after.
+static void churn_phase(const char* name, const size_t first, const size_t last, bool (*pick)(size_t),
+                        const size_t max_value, uint64_t* seed)
+{
+    static const uint8_t value[64] = {};
+    char key[32];
+    size_t n = 0;
+    const uint64_t start = bench_nsec();
+    for (size_t i = first; i < last; ++i) {
+        if (pick != NULL && !pick(i)) {
+            continue;
+        }
+        Lookup_Key k;
+        lookup_key_init(&k, Slice{ (const uint8_t*)key, (size_t)snprintf(key, sizeof(key), "key:%zu", i) });
+        if (max_value > 0) {
+            db_set(&k, db_lookup(&k), Slice{ value, 1 + bench_rand(seed) % max_value });
+        } else {
+            Entry* entry = db_pop(&k);
+            assert(entry != NULL);
+            entry_unref(entry);
+        }
+        ++n;
+    }
+    const uint64_t elapsed = bench_nsec() - start;
+    printf("  %-22s %8zu ops %8.1f ns/op  rss %7.1f MiB\n",
+           name, n, (double)elapsed / n, bench_rss() / 1048576.0);
+}
+
+static bool churn_most(const size_t i)
+{
+    return i % 10 != 0;
+}
+
+static bool churn_rest(const size_t i)
+{
+    return i % 10 == 0;
+}
+
+// Inserts keys, deletes most of them, inserts new keys of other sizes,
+// then deletes everything; each allocator runs in a child process of its
+// own, so both start from a fresh heap.
+static void bench_churn()
+{
+    const size_t nkeys = 1000000;
+    const char* names[] = { "slab", "malloc" };
+    for (uint32_t allocator = ALLOC_SLAB; allocator <= ALLOC_MALLOC; ++allocator) {
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (pid < 0) {
+            die("fork()");
+        }
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+            continue;
+        }
+        g_config.allocator = allocator;
+        uint64_t seed = 0x9E3779B97F4A7C15ull;
+        printf("%s, start rss %.1f MiB\n", names[allocator], bench_rss() / 1048576.0);
+        churn_phase("set 1..64 bytes", 0, nkeys, NULL, 64, &seed);
+        churn_phase("del 90%", 0, nkeys, &churn_most, 0, &seed);
+        churn_phase("set new 1..32 bytes", nkeys, 2 * nkeys, NULL, 32, &seed);
+        churn_phase("del rest of old", 0, nkeys, &churn_rest, 0, &seed);
+        churn_phase("del new", nkeys, 2 * nkeys, NULL, 0, &seed);
+        if (allocator == ALLOC_SLAB) {
+            slab_release_empty();
+            printf("  %-22s %37s %7.1f MiB\n", "release empty slabs", "rss", bench_rss() / 1048576.0);
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+}
+
+// The Entry layout used before the packed one, kept for comparison.
+struct Legacy_Entry
+{
+    struct Hash_Node node;
+    uint32_t refs;
+    std::string key;
+    std::string value;
+};
+
+static size_t heap_bytes()
+{
+    return mallinfo2().uordblks;
+}
+
+// Heap bytes per key, table excluded, for both layouts.
+static void bench_memory()
+{
+    const size_t nkeys = 1000000;
+    const size_t value_sizes[] = { 8, 32, 64, 256 };
+    char key[32];
+    for (const size_t vsize : value_sizes) {
+        const std::string value(vsize, 'v');
+        const Slice value_slice = { (const uint8_t*)value.data(), value.size() };
+
+        std::vector<Legacy_Entry*> legacy(nkeys);
+        size_t before = heap_bytes();
+        for (size_t i = 0; i < nkeys; ++i) {
+            Legacy_Entry* entry = new Legacy_Entry;
+            entry->key.assign(key, snprintf(key, sizeof(key), "key:%zu", i));
+            entry->value = value;
+            legacy[i] = entry;
+        }
+        const double legacy_bytes = (double)(heap_bytes() - before) / nkeys;
+        for (Legacy_Entry* entry : legacy) {
+            delete entry;
+        }
+
+        std::vector<Entry*> packed(nkeys);
+        before = heap_bytes();
+        for (size_t i = 0; i < nkeys; ++i) {
+            const Slice key_slice = { (const uint8_t*)key, (size_t)snprintf(key, sizeof(key), "key:%zu", i) };
+            packed[i] = entry_new(key_slice, 0, value_slice);
+        }
+        const double packed_bytes = (double)(heap_bytes() - before) / nkeys;
+        for (Entry* entry : packed) {
+            entry_unref(entry);
+        }
+
+        printf("%4zu byte values: %6.1f bytes/key before, %6.1f packed (%.0f%% less)\n",
+               vsize, legacy_bytes, packed_bytes, 100.0 * (1.0 - packed_bytes / legacy_bytes));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* what = argc > 1 ? argv[1] : "get";
+    if (0 == strcmp(what, "get")) {
+        bench_get(100000, 1000000);
+    } else if (0 == strcmp(what, "engines")) {
+        bench_engines();
+    } else if (0 == strcmp(what, "hash")) {
+        bench_hash();
+    } else if (0 == strcmp(what, "memory")) {
+        bench_memory();
+    } else if (0 == strcmp(what, "mget")) {
+        bench_mget();
+    } else if (0 == strcmp(what, "churn")) {
+        bench_churn();
+    } else {
+        fprintf(stderr, "usage: %s get|engines|hash|memory|mget|churn\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+// Size classes are the powers of two from 4 KiB to 1 MiB; larger blocks
+// come straight from malloc.
+#define MIN_CLASS_SHIFT     12
+#define MAX_CLASS_SHIFT     20
+#define NUM_CLASSES         (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+// Upper bound of idle bytes each thread keeps per size class.
+#define MAX_POOLED_BYTES    (4 << 20)
+
+struct Free_Block
+{
+    Free_Block* next;
+};
+
+struct Buffer_Pool
+{
+    Free_Block* free_list[NUM_CLASSES];
+    size_t free_count[NUM_CLASSES];
+};
+
+static thread_local Buffer_Pool g_pool;
+static size_t g_bytes_in_use;
+static size_t g_bytes_pooled;
+
+static inline size_t size_class(const size_t n)
+{
+    size_t shift = MIN_CLASS_SHIFT;
+    while (((size_t)1 << shift) < n) {
+        ++shift;
+    }
+    return shift - MIN_CLASS_SHIFT;
+}
+
+static inline size_t class_size(const size_t cls)
+{
+    return (size_t)1 << (cls + MIN_CLASS_SHIFT);
+}
+
+static inline size_t block_capacity(const size_t n)
+{
+    return n > class_size(NUM_CLASSES - 1) ? n : class_size(size_class(n));
+}
+
+static uint8_t* block_alloc(const size_t capacity)
+{
+    uint8_t* data = NULL;
+    if (capacity <= class_size(NUM_CLASSES - 1)) {
+        const size_t cls = size_class(capacity);
+        Free_Block* block = g_pool.free_list[cls];
+        if (block != NULL) {
+            g_pool.free_list[cls] = block->next;
+            --g_pool.free_count[cls];
+            __atomic_fetch_sub(&g_bytes_pooled, capacity, __ATOMIC_RELAXED);
+            data = (uint8_t*)block;
+        }
+    }
+    if (data == NULL) {
+        data = (uint8_t*)malloc(capacity);
+    }
+    if (data != NULL) {
+        __atomic_fetch_add(&g_bytes_in_use, capacity, __ATOMIC_RELAXED);
+    }
+    return data;
+}
+
+static void block_free(uint8_t* data, const size_t capacity)
+{
+    __atomic_fetch_sub(&g_bytes_in_use, capacity, __ATOMIC_RELAXED);
+    if (capacity <= class_size(NUM_CLASSES - 1)) {
+        const size_t cls = size_class(capacity);
+        if (g_pool.free_count[cls] * capacity < MAX_POOLED_BYTES) {
+            Free_Block* block = (Free_Block*)data;
+            block->next = g_pool.free_list[cls];
+            g_pool.free_list[cls] = block;
+            ++g_pool.free_count[cls];
+            __atomic_fetch_add(&g_bytes_pooled, capacity, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    free(data);
+}
+
+void buf_init(Buffer* buf)
+{
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+bool buf_reserve(Buffer* buf, const size_t n)
+{
+    if (buf->capacity - buf->size >= n) {
+        return true;
+    }
+
+    size_t capacity = buf->capacity * 2;
+    if (capacity < buf->size + n) {
+        capacity = buf->size + n;
+    }
+    capacity = block_capacity(capacity);
+    uint8_t* data = block_alloc(capacity);
+    if (data == NULL) {
+        return false;
+    }
+    if (buf->data != NULL) {
+        memcpy(data, buf->data, buf->size);
+        block_free(buf->data, buf->capacity);
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
+
+void buf_append(Buffer* buf, const void* data, const size_t n)
+{
+    if (!buf_reserve(buf, n)) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    memcpy(&buf->data[buf->size], data, n);
+    buf->size += n;
+}
+
+void buf_consume(Buffer* buf, const size_t n)
+{
+    assert(n <= buf->size);
+    const size_t remain = buf->size - n;
+    if (remain == 0) {
+        buf_free(buf);
+        return;
+    }
+    const size_t capacity = block_capacity(remain);
+    uint8_t* data = NULL;
+    if (capacity < buf->capacity && capacity == class_size(0)) {
+        data = block_alloc(capacity);
+    }
+    if (data != NULL) {
+        memcpy(data, &buf->data[n], remain);
+        block_free(buf->data, buf->capacity);
+        buf->data = data;
+        buf->capacity = capacity;
+    } else {
+        memmove(buf->data, &buf->data[n], remain);
+    }
+    buf->size = remain;
+}
+
+void buf_truncate(Buffer* buf, const size_t n)
+{
+    assert(n <= buf->size);
+    buf->size = n;
+}
+
+void buf_free(Buffer* buf)
+{
+    if (buf->data != NULL) {
+        block_free(buf->data, buf->capacity);
+    }
+    buf_init(buf);
+}
+
+size_t buf_bytes_in_use()
+{
+    return __atomic_load_n(&g_bytes_in_use, __ATOMIC_RELAXED);
+}
+
+size_t buf_bytes_pooled()
+{
+    return __atomic_load_n(&g_bytes_pooled, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,34 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte buffer whose storage is taken lazily from a per-thread size-class
+ * pool and handed back as soon as the buffer drains, so memory follows the
+ * number of active clients rather than connected ones.
+ */
+struct Buffer
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+};
+
+void buf_init(Buffer* buf);
+// Makes room for `n` more bytes; false if out of memory.
+bool buf_reserve(Buffer* buf, size_t n);
+void buf_append(Buffer* buf, const void* data, size_t n);
+// Drops `n` bytes from the front; the storage goes back to the pool once
+// the buffer is empty, or moves to a smaller block once the rest fits one.
+void buf_consume(Buffer* buf, size_t n);
+// Drops everything past the first `n` bytes; the storage is kept.
+void buf_truncate(Buffer* buf, size_t n);
+void buf_free(Buffer* buf);
+
+// Process-wide totals: bytes held by live buffers and by the pools.
+size_t buf_bytes_in_use();
+size_t buf_bytes_pooled();
+
+#endif // __BUFFER_H__
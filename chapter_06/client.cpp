@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <errno.h>
 #include <unistd.h>
@@ -14,7 +15,7 @@
 #define HEADER_SIZE           4
 
 #define SMALL_BUFFER_SIZE     64
-#define MAX_MESSAGE_SIZE      4096
+#define MAX_MESSAGE_SIZE      (64 << 20)
 
 enum
 {
@@ -23,6 +24,7 @@ enum
     SER_STR = 2,
     SER_INT = 3,
     SER_ARR = 4,
+    SER_DBL = 5,
 };
 
 static inline void msg(const char* msg)
@@ -77,8 +79,8 @@ static inline int32_t send_req(const int fd, const std::vector<std::string>& cmd
         return -1;
     }
 
-    char wbuf[HEADER_SIZE + MAX_MESSAGE_SIZE];
-    memcpy(&wbuf, &len, HEADER_SIZE);
+    std::vector<char> wbuf(HEADER_SIZE + len);
+    memcpy(&wbuf[0], &len, HEADER_SIZE);
     const uint32_t n = cmd.size();
     memcpy(&wbuf[HEADER_SIZE], &n, HEADER_SIZE);
     size_t cur = HEADER_SIZE + HEADER_SIZE;
@@ -88,7 +90,7 @@ static inline int32_t send_req(const int fd, const std::vector<std::string>& cmd
         memcpy(&wbuf[cur + HEADER_SIZE], cmd[i].data(), cmd[i].size());
         cur += HEADER_SIZE + cmd[i].size();
     }
-    return write_all(fd, wbuf, HEADER_SIZE + len);
+    return write_all(fd, wbuf.data(), HEADER_SIZE + len);
 }
 
 static inline int32_t on_response(const uint8_t* data, const size_t size)
@@ -142,7 +144,18 @@ static inline int32_t on_response(const uint8_t* data, const size_t size)
             int64_t value = 0;
             memcpy(&value, &data[1], 2 * HEADER_SIZE);
             printf("(int) %ld\n", value);
-            return 1 + HEADER_SIZE;
+            return 1 + 2 * HEADER_SIZE;
+        }
+    case SER_DBL:
+        if (size < 1 + sizeof(double)) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            double value = 0;
+            memcpy(&value, &data[1], sizeof(value));
+            printf("(dbl) %g\n", value);
+            return 1 + sizeof(double);
         }
     case SER_ARR:
         if (size < 1 + HEADER_SIZE) {
@@ -172,9 +185,9 @@ static inline int32_t on_response(const uint8_t* data, const size_t size)
 
 static inline int32_t read_res(const int fd)
 {
-    char rbuf[HEADER_SIZE + MAX_MESSAGE_SIZE + 1];
+    std::vector<char> rbuf(HEADER_SIZE);
     errno = 0;
-    int32_t err = read_full(fd, rbuf, HEADER_SIZE);
+    int32_t err = read_full(fd, rbuf.data(), HEADER_SIZE);
     if (0 != err) {
         if (0 == errno) {
             msg("EOF");
@@ -185,12 +198,13 @@ static inline int32_t read_res(const int fd)
     }
 
     uint32_t len = 0;
-    memcpy(&len, rbuf, HEADER_SIZE);
+    memcpy(&len, rbuf.data(), HEADER_SIZE);
     if (len > MAX_MESSAGE_SIZE) {
         msg("too long");
         return -1;
     }
 
+    rbuf.resize(HEADER_SIZE + len + 1);
     err = read_full(fd, &rbuf[HEADER_SIZE], len);
     if (0 != err) {
         msg("read() error");
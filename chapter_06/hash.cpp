@@ -0,0 +1,114 @@
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+static const uint64_t g_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static uint64_t g_seed;
+
+static inline void mum(uint64_t* a, uint64_t* b)
+{
+    const __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read8(const uint8_t* p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read4(const uint8_t* p)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// 1 to 3 bytes, without branching on the length.
+static inline uint64_t read3(const uint8_t* p, const size_t k)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash_bytes_seeded(const void* data, const size_t len, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    seed ^= mix(seed ^ g_secret[0], g_secret[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping reads from each end cover 4 to 16 bytes.
+            const size_t off = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + off);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - off);
+        } else if (len > 0) {
+            a = read3(p, len);
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy.
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do {
+                seed = mix(read8(p) ^ g_secret[1], read8(p + 8) ^ seed);
+                see1 = mix(read8(p + 16) ^ g_secret[2], read8(p + 24) ^ see1);
+                see2 = mix(read8(p + 32) ^ g_secret[3], read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read8(p) ^ g_secret[1], read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= g_secret[1];
+    b ^= seed;
+    mum(&a, &b);
+    return mix(a ^ g_secret[0] ^ len, b ^ g_secret[1]);
+}
+
+uint64_t hash_bytes(const void* data, const size_t len)
+{
+    return hash_bytes_seeded(data, len, g_seed);
+}
+
+void hash_init()
+{
+    uint64_t seed = 0;
+    const int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+            seed = 0;
+        }
+        close(fd);
+    }
+    if (seed == 0) {
+        // Still differs between runs, if less so.
+        struct timespec tv = {};
+        clock_gettime(CLOCK_REALTIME, &tv);
+        seed = mix((uint64_t)tv.tv_sec ^ g_secret[2], (uint64_t)tv.tv_nsec ^ ((uint64_t)getpid() << 32));
+    }
+    g_seed = seed;
+}
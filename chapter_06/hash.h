@@ -0,0 +1,18 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 64-bit keyed hash of the wyhash family: 8 bytes per step through 64x64->128
+ * bit multiplies. The per-process random seed keeps clients from picking
+ * keys that all land in one bucket.
+ */
+
+// Picks the seed; call once before any thread hashes.
+void hash_init();
+uint64_t hash_bytes(const void* data, size_t len);
+uint64_t hash_bytes_seeded(const void* data, size_t len, uint64_t seed);
+
+#endif // __HASH_H__
@@ -1,124 +1,149 @@
-#include <assert.h>
 #include <stdlib.h>
 
 #include "hashtable.h"
 
-#define RESIZING_WORK 128
-#define MAX_LOAD_FACTOR 8
-#define MIN_CAPACITY 4
+// The C API: keys are nodes, compared by the caller's callback.
+struct Callback_Key
+{
+    Hash_Node* node;
+    bool (*eq)(Hash_Node *, Hash_Node *);
+};
 
-static inline void h_init(Hash_Table* htab, const size_t n)
+struct Plain_Node
 {
-    // Must be power of 2
-    assert(n > 0 && ((n - 1) & n) == 0);
-    htab->table = (Hash_Node**)calloc(sizeof(Hash_Node *), n);
-    htab->mask = n - 1;
-    htab->size = 0;
-}
+    Hash_Node node;
+};
 
-static inline void h_insert(Hash_Table* htab, Hash_Node* node)
+struct Callback_Traits
 {
-    const size_t pos = node->hcode & htab->mask;
-    Hash_Node* next = htab->table[pos];
-    node->next = next;
-    htab->table[pos] = node;
-    ++htab->size;
+    static inline bool eq(const Plain_Node* node, const Callback_Key& key)
+    {
+        return key.eq((Hash_Node*)&node->node, key.node);
+    }
+};
+
+typedef Hash_Map_T<Plain_Node, Callback_Key, Callback_Traits> Callback_Map;
+
+// Main Interface
+
+Hash_Node* hm_lookup(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+{
+    const Callback_Key k = { key, eq };
+    Plain_Node* node = Callback_Map::lookup(hmap, k, key->hcode);
+    return node != NULL ? &node->node : NULL;
 }
 
-static inline Hash_Node** h_lookup(Hash_Table* htab, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+void hm_insert(Hash_Map* hmap, Hash_Node* node)
 {
-    if (NULL == htab->table) {
-        return NULL;
-    }
+    Callback_Map::insert(hmap, (Plain_Node*)node);
+}
 
-    const size_t pos = key->hcode & htab->mask;
-    Hash_Node **from = &htab->table[pos];
-    for (Hash_Node* current; (current = *from) != NULL; from = &current->next) {
-        if (current->hcode == key->hcode && eq(current, key)) {
-            return from;
-        }
-    }
-    return NULL;
+Hash_Node* hm_pop(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+{
+    const Callback_Key k = { key, eq };
+    Plain_Node* node = Callback_Map::pop(hmap, k, key->hcode);
+    return node != NULL ? &node->node : NULL;
 }
 
-static inline Hash_Node* h_detach(Hash_Table* htab, Hash_Node** from)
+size_t hm_size(Hash_Map* hmap)
 {
-    Hash_Node* node = *from;
-    *from = node->next;
-    --htab->size;
-    return node;
+    return hmap->table1.size + hmap->table2.size;
 }
 
-static inline void hm_resizing_helper(Hash_Map* hmap)
+static inline void h_scan(Hash_Table* htab, void (*f)(Hash_Node*, void*), void* arg)
 {
-    size_t nwork = 0;
-    while (nwork < RESIZING_WORK && hmap->table2.size > 0) {
-        Hash_Node** from = &hmap->table2.table[hmap->resizing_pos];
-        if (*from != NULL) {
-            ++hmap->resizing_pos;
-            continue;
-        }
-        h_insert(&hmap->table1, h_detach(&hmap->table2, from));
-        ++nwork;
+    if (htab->size == 0) {
+        return;
     }
-    if (hmap->table2.size == 0 && hmap->table2.table != NULL) {
-        free(hmap->table2.table);
-        hmap->table2.table = NULL;
-        hmap->table2.mask = hmap->table2.size = 0;
+    for (size_t i = 0; i < htab->mask + 1; ++i) {
+        for (Hash_Node* node = htab->table[i]; node != NULL; node = node->next) {
+            f(node, arg);
+        }
     }
 }
 
-static inline void hm_start_resizing(Hash_Map* hmap)
+void hm_foreach(Hash_Map* hmap, void (*f)(Hash_Node*, void*), void* arg)
 {
-    assert(hmap->table2.table == NULL);
-    hmap->table2 = hmap->table1;
-    h_init(&hmap->table1, (hmap->table1.mask + 1) * 2);
-    hmap->resizing_pos = 0;
+    h_scan(&hmap->table1, f, arg);
+    h_scan(&hmap->table2, f, arg);
 }
 
-// Main Interface
+static inline void h_scan_bucket(Hash_Table* htab, const size_t pos, void (*f)(Hash_Node*, void*), void* arg)
+{
+    for (Hash_Node* node = htab->table[pos]; node != NULL; node = node->next) {
+        f(node, arg);
+    }
+}
 
-Hash_Node* hm_lookup(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+/*
+ * While resizing, bucket i of the smaller table holds the keys of buckets
+ * i, i + small, i + 2 * small, ... of the larger one. One step visits all of
+ * them, and the cursor walks the larger table's buckets in reverse binary
+ * order, in which those buckets are consecutive.
+ */
+uint64_t hm_scan(Hash_Map* hmap, uint64_t cursor, void (*f)(Hash_Node*, void*), void* arg)
 {
-    hm_resizing_helper(hmap);
-    Hash_Node** from = h_lookup(&hmap->table1, key, eq);
-    from = from ? from : h_lookup(&hmap->table2, key, eq);
-    return from ? *from : NULL;
+    Hash_Table* small = &hmap->table1;
+    Hash_Table* large = &hmap->table2;
+    if (NULL == large->table) {
+        if (NULL == small->table) {
+            return 0;
+        }
+        h_scan_bucket(small, cursor & small->mask, f, arg);
+        return scan_cursor_next(cursor, small->mask);
+    }
+    if (small->mask > large->mask) {
+        Hash_Table* tmp = small;
+        small = large;
+        large = tmp;
+    }
+    h_scan_bucket(small, cursor & small->mask, f, arg);
+    do {
+        h_scan_bucket(large, cursor & large->mask, f, arg);
+        cursor = scan_cursor_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
 }
 
-void hm_insert(Hash_Map* hmap, Hash_Node* node)
+static inline void h_prefetch_bucket(const Hash_Table* htab, const uint64_t hcode)
 {
-    if (NULL == hmap->table1.table) {
-        h_init(&hmap->table1, MIN_CAPACITY);
+    if (htab->table != NULL) {
+        __builtin_prefetch(&htab->table[hcode & htab->mask]);
     }
-    h_insert(&hmap->table1, node);
+}
 
-    if (NULL == hmap->table2.table) {
-        const size_t load_factor = hmap->table1.size / (hmap->table1.mask + 1);
-        if (load_factor >= MAX_LOAD_FACTOR) {
-            hm_start_resizing(hmap);
+static inline void h_prefetch_node(const Hash_Table* htab, const uint64_t hcode)
+{
+    if (htab->table != NULL) {
+        const Hash_Node* node = htab->table[hcode & htab->mask];
+        if (node != NULL) {
+            __builtin_prefetch(node);
         }
     }
-    hm_resizing_helper(hmap);
 }
 
-Hash_Node* hm_pop(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+void hm_prefetch_bucket(Hash_Map* hmap, const uint64_t hcode)
 {
-    hm_resizing_helper(hmap);
-    Hash_Node** from = h_lookup(&hmap->table1, key, eq);
-    if (from != NULL) {
-       return h_detach(&hmap->table1, from); 
-    }
-    from = h_lookup(&hmap->table2, key, eq);
-    if (from != NULL) {
-        return h_detach(&hmap->table2, from);
-    }
-    return NULL;
+    h_prefetch_bucket(&hmap->table1, hcode);
+    h_prefetch_bucket(&hmap->table2, hcode);
 }
 
-size_t hm_size(Hash_Map* hmap)
+void hm_prefetch_node(Hash_Map* hmap, const uint64_t hcode)
 {
-    return hmap->table1.size + hmap->table2.size;
+    h_prefetch_node(&hmap->table1, hcode);
+    h_prefetch_node(&hmap->table2, hcode);
+}
+
+size_t hm_bucket_bytes(Hash_Map* hmap)
+{
+    size_t n = 0;
+    if (hmap->table1.table != NULL) {
+        n += hmap->table1.mask + 1;
+    }
+    if (hmap->table2.table != NULL) {
+        n += hmap->table2.mask + 1;
+    }
+    return n * sizeof(Hash_Node *);
 }
 
 void hm_destroy(Hash_Map* hmap)
@@ -126,7 +151,7 @@ void hm_destroy(Hash_Map* hmap)
     free(hmap->table1.table);
     free(hmap->table2.table);
     hmap->table1.table = NULL;
-    hmap->table1.mask = hmap->table2.size = 0;
+    hmap->table1.mask = hmap->table1.size = 0;
     hmap->table2.table = NULL;
     hmap->table2.mask = hmap->table2.size = 0;
     hmap->resizing_pos = 0;
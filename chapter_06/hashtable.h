@@ -1,8 +1,10 @@
 #ifndef __HASH_TABLE_H__
 #define __HASH_TABLE_H__
 
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 struct Hash_Node
 {
@@ -28,7 +30,187 @@ Hash_Node* hm_lookup(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Has
 void hm_insert(Hash_Map* hmap, Hash_Node* node);
 Hash_Node* hm_pop(Hash_Map* hmap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *));
 size_t hm_size(Hash_Map* hmap);
+void hm_foreach(Hash_Map* hmap, void (*f)(Hash_Node*, void*), void* arg);
+/*
+ * Visits the buckets named by `cursor` and returns the next cursor, 0 once
+ * the scan is complete. Cursors count in reverse binary, so a scan started
+ * with 0 sees every key present throughout, even if the table grows,
+ * shrinks or is halfway through a resize between calls.
+ */
+uint64_t hm_scan(Hash_Map* hmap, uint64_t cursor, void (*f)(Hash_Node*, void*), void* arg);
+/*
+ * Hints for batched lookups, so the cache misses of many keys overlap:
+ * hm_prefetch_bucket pulls in the bucket slot of `hcode`, hm_prefetch_node
+ * its first node. The latter reads the slot, so issue it for a key only
+ * once that key's bucket had time to arrive. Neither changes the map.
+ */
+void hm_prefetch_bucket(Hash_Map* hmap, uint64_t hcode);
+void hm_prefetch_node(Hash_Map* hmap, uint64_t hcode);
+// Bytes of the bucket arrays, the old one included while resizing.
+size_t hm_bucket_bytes(Hash_Map* hmap);
 void hm_destroy(Hash_Map* hmap);
 
+static inline uint64_t bit_reverse64(uint64_t v)
+{
+    v = __builtin_bswap64(v);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    return v;
+}
+
+// Increments the bits of `cursor` under `mask` from the top down.
+static inline uint64_t scan_cursor_next(const uint64_t cursor, const uint64_t mask)
+{
+    return bit_reverse64(bit_reverse64(cursor | ~mask) + 1);
+}
+
+// Inline core shared by the C API and Hash_Map_T.
+
+#define HM_RESIZING_WORK 128
+#define HM_MAX_LOAD_FACTOR 8
+// Shrink to half once the load factor drops below 1. Halving leaves the
+// load below 2, far from both limits, so add/remove cycles do not thrash.
+#define HM_MIN_LOAD_FACTOR 1
+#define HM_MIN_CAPACITY 4
+
+static inline void h_init(Hash_Table* htab, const size_t n)
+{
+    // Must be power of 2
+    assert(n > 0 && ((n - 1) & n) == 0);
+    htab->table = (Hash_Node**)calloc(sizeof(Hash_Node *), n);
+    htab->mask = n - 1;
+    htab->size = 0;
+}
+
+static inline void h_insert(Hash_Table* htab, Hash_Node* node)
+{
+    const size_t pos = node->hcode & htab->mask;
+    Hash_Node* next = htab->table[pos];
+    node->next = next;
+    htab->table[pos] = node;
+    ++htab->size;
+}
+
+static inline Hash_Node* h_detach(Hash_Table* htab, Hash_Node** from)
+{
+    Hash_Node* node = *from;
+    *from = node->next;
+    --htab->size;
+    return node;
+}
+
+static inline void hm_resizing_helper(Hash_Map* hmap)
+{
+    size_t nwork = 0;
+    while (nwork < HM_RESIZING_WORK && hmap->table2.size > 0) {
+        Hash_Node** from = &hmap->table2.table[hmap->resizing_pos];
+        if (*from == NULL) {
+            ++hmap->resizing_pos;
+            continue;
+        }
+        h_insert(&hmap->table1, h_detach(&hmap->table2, from));
+        ++nwork;
+    }
+    if (hmap->table2.size == 0 && hmap->table2.table != NULL) {
+        free(hmap->table2.table);
+        hmap->table2.table = NULL;
+        hmap->table2.mask = hmap->table2.size = 0;
+    }
+}
+
+// Moves table1 aside to table2 and lets hm_resizing_helper drain it into a
+// new table1 of `n` buckets, bigger or smaller.
+static inline void hm_start_resizing(Hash_Map* hmap, const size_t n)
+{
+    assert(hmap->table2.table == NULL);
+    hmap->table2 = hmap->table1;
+    h_init(&hmap->table1, n);
+    hmap->resizing_pos = 0;
+}
+
+static inline void hm_maybe_shrink(Hash_Map* hmap)
+{
+    const size_t capacity = hmap->table1.mask + 1;
+    if (NULL == hmap->table2.table && capacity > HM_MIN_CAPACITY
+            && hmap->table1.size < capacity * HM_MIN_LOAD_FACTOR) {
+        hm_start_resizing(hmap, capacity / 2);
+    }
+}
+
+/*
+ * Typed operations on a Hash_Map whose nodes are the `node` member of Node,
+ * searched by a borrowed Key (e.g. pointer and length) instead of a node.
+ * Traits supplies
+ *     static bool eq(const Node* node, const Key& key);
+ * which is inlined into the probe loop, unlike the hm_ callbacks. The map
+ * stays a plain Hash_Map, so hm_scan and friends work on it unchanged.
+ */
+template <typename Node, typename Key, typename Traits>
+struct Hash_Map_T
+{
+    static inline Node* container(Hash_Node* node)
+    {
+        return (Node*)((char*)node - offsetof(Node, node));
+    }
+
+    static inline Hash_Node** find(Hash_Table* htab, const Key& key, const uint64_t hcode)
+    {
+        if (NULL == htab->table) {
+            return NULL;
+        }
+        Hash_Node** from = &htab->table[hcode & htab->mask];
+        for (Hash_Node* current; (current = *from) != NULL; from = &current->next) {
+            if (current->hcode == hcode && Traits::eq(container(current), key)) {
+                return from;
+            }
+        }
+        return NULL;
+    }
+
+    // `hcode` is the hash of `key`, as stored in the nodes.
+    static Node* lookup(Hash_Map* hmap, const Key& key, const uint64_t hcode)
+    {
+        hm_resizing_helper(hmap);
+        Hash_Node** from = find(&hmap->table1, key, hcode);
+        from = from ? from : find(&hmap->table2, key, hcode);
+        return from ? container(*from) : NULL;
+    }
+
+    // node->node.hcode must be set.
+    static void insert(Hash_Map* hmap, Node* node)
+    {
+        if (NULL == hmap->table1.table) {
+            h_init(&hmap->table1, HM_MIN_CAPACITY);
+        }
+        h_insert(&hmap->table1, &node->node);
+
+        if (NULL == hmap->table2.table) {
+            const size_t load_factor = hmap->table1.size / (hmap->table1.mask + 1);
+            if (load_factor >= HM_MAX_LOAD_FACTOR) {
+                hm_start_resizing(hmap, (hmap->table1.mask + 1) * 2);
+            }
+        }
+        hm_resizing_helper(hmap);
+    }
+
+    static Node* pop(Hash_Map* hmap, const Key& key, const uint64_t hcode)
+    {
+        hm_resizing_helper(hmap);
+        Hash_Node** from = find(&hmap->table1, key, hcode);
+        Hash_Node* node = NULL;
+        if (from != NULL) {
+            node = h_detach(&hmap->table1, from);
+        } else if ((from = find(&hmap->table2, key, hcode)) != NULL) {
+            node = h_detach(&hmap->table2, from);
+        }
+        if (NULL == node) {
+            return NULL;
+        }
+        hm_maybe_shrink(hmap);
+        return container(node);
+    }
+};
+
 #endif // __HASH_TABLE_H__
 
@@ -0,0 +1,43 @@
+#include "mpsc_queue.h"
+
+void mpsc_init(Mpsc_Queue* queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    __atomic_store_n(&queue->tail, &queue->stub, __ATOMIC_RELEASE);
+}
+
+void mpsc_push(Mpsc_Queue* queue, Mpsc_Node* node)
+{
+    __atomic_store_n(&node->next, (Mpsc_Node*)NULL, __ATOMIC_RELAXED);
+    Mpsc_Node* prev = __atomic_exchange_n(&queue->tail, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+Mpsc_Node* mpsc_pop(Mpsc_Queue* queue)
+{
+    Mpsc_Node* head = queue->head;
+    Mpsc_Node* next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &queue->stub) {
+        if (NULL == next) {
+            return NULL;
+        }
+        queue->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (NULL != next) {
+        queue->head = next;
+        return head;
+    }
+    if (head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    // `head` is the last node: park the stub behind it so it can be taken.
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (NULL != next) {
+        queue->head = next;
+        return head;
+    }
+    return NULL;
+}
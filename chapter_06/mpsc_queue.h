@@ -0,0 +1,29 @@
+#ifndef __MPSC_QUEUE_H__
+#define __MPSC_QUEUE_H__
+
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Intrusive multi-producer single-consumer queue (Vyukov), lock-free.
+struct Mpsc_Node
+{
+    Mpsc_Node* next;
+};
+
+struct Mpsc_Queue
+{
+    Mpsc_Node* tail;
+    char pad[CACHE_LINE_SIZE - sizeof(Mpsc_Node*)];
+    Mpsc_Node* head;
+    Mpsc_Node stub;
+};
+
+void mpsc_init(Mpsc_Queue* queue);
+// Any thread.
+void mpsc_push(Mpsc_Queue* queue, Mpsc_Node* node);
+// Consumer thread only. May return NULL while a push is half done; the
+// producer is expected to signal the consumer after pushing.
+Mpsc_Node* mpsc_pop(Mpsc_Queue* queue);
+
+#endif // __MPSC_QUEUE_H__
@@ -4,21 +4,68 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <string>
 #include <vector>
 
+#include "buffer.h"
+#include "hash.h"
 #include "hashtable.h"
+#include "mpsc_queue.h"
+#include "slab.h"
+#include "swisstable.h"
+#include "timer.h"
+#include "uring.h"
+#include "zset.h"
 
 #define HEADER_SIZE           4
 
 #define SMALL_BUFFER_SIZE     64
-#define MAX_MESSAGE_SIZE      4096
+// Queued responses are flushed once they reach this much, so a pipelined
+// batch still goes out in one write while wbuf stays in a small block.
+#define WBUF_BATCH_SIZE       4096
+// GET replies of values at least this big point at the stored value instead
+// of copying it into wbuf; below it a copy is cheaper than the bookkeeping.
+#define ZEROCOPY_MIN_SIZE     (16 << 10)
+#define SEND_IOV_MAX          64
+#define MIN_MAX_MESSAGE_SIZE  4096
+// Values run up to 1 MB; the cap bounds requests and responses alike.
+#define DEFAULT_MAX_MESSAGE_SIZE  (4 << 20)
+
+#define DEFAULT_IDLE_TIMEOUT_MS   (300 * 1000)
+// How often each thread unmaps the empty slabs it keeps for reuse.
+#define SLAB_RELEASE_MS       (5 * 1000)
+#define EPOLL_MAX_EVENTS      256
+#define URING_ENTRIES         4096
+#define MAX_SHARDS            64
+// Keys of an MGET or MSET looked up together; their prefetched lines must
+// still be cached when the lookups run.
+#define MULTI_BATCH           32
+// Longer values are kept out of line, see Entry.
+#define ENTRY_INLINE_MAX      64
+#define ENTRY_STR             0
+#define ENTRY_INT             1
+#define ENTRY_ZSET            2
+// SCAN cursors carry the shard being scanned in their low bits.
+#define SCAN_SHARD_BITS       6
+#define SCAN_DEFAULT_COUNT    10
+// Buckets a SCAN call may visit per requested key, so sparse tables do not
+// make one call walk far.
+#define SCAN_MAX_WORK         10
 
 #define CONTAINER_OF(ptr, type, member) ({ \
     const typeof( ((type*)0)->member )* __mptr = (ptr); \
@@ -29,6 +76,7 @@ enum
     STATE_REQ = 0,
     STATE_RES = 1,
     STATE_END = 2,
+    STATE_WAIT = 3, // a forwarded request is being served by another shard
 };
 
 enum
@@ -41,7 +89,9 @@ enum
 enum
 {
     ERR_UNKNOWN = 1,
-    ERR_2BIG    = 2
+    ERR_2BIG    = 2,
+    ERR_ARG     = 3,
+    ERR_TYPE    = 4,
 };
 
 enum
@@ -51,45 +101,254 @@ enum
     SER_STR = 2,
     SER_INT = 3,
     SER_ARR = 4,
+    SER_DBL = 5,
 };
 
+struct Shard_Msg;
+struct Out_Ref;
+
 struct Connection
 {
     int fd;
     uint32_t state;
-    size_t rbuf_size;
-    uint8_t rbuf[HEADER_SIZE + MAX_MESSAGE_SIZE];
-    size_t wbuf_size;
+    uint32_t pending;
+    Shard_Msg* replies;
+    Buffer rbuf;
+    Buffer wbuf;
     size_t wbuf_sent;
-    uint8_t wbuf[HEADER_SIZE + MAX_MESSAGE_SIZE];
+    // Values sent from pinned entries, spliced into the wbuf stream.
+    Out_Ref* refs;
+    Out_Ref* refs_tail;
+    size_t ref_bytes;
+    size_t ref_sent;
+    Timer idle_timer;
+};
+
+// Interchangeable keyspace engines, picked at startup with --hash-engine.
+enum
+{
+    ENGINE_CHAIN = 0,
+    ENGINE_SWISS = 1,
+};
+
+// Where entries and connections come from, picked with --allocator.
+enum
+{
+    ALLOC_SLAB   = 0,
+    ALLOC_MALLOC = 1,
 };
 
 static struct
+{
+    size_t max_message_size;
+    uint64_t idle_timeout_ms;
+    uint32_t hash_engine;
+    uint32_t allocator;
+    // Index of new sorted sets, picked with --zset-engine.
+    uint32_t zset_engine;
+} g_config = { DEFAULT_MAX_MESSAGE_SIZE, DEFAULT_IDLE_TIMEOUT_MS, ENGINE_CHAIN, ALLOC_SLAB, ZSET_AVL };
+
+static inline void* obj_alloc(const size_t size)
+{
+    return g_config.allocator == ALLOC_SLAB ? slab_alloc(size) : malloc(size);
+}
+
+// `size` must be the one given to obj_alloc.
+static inline void obj_free(void* p, const size_t size)
+{
+    if (g_config.allocator == ALLOC_SLAB) {
+        return slab_free(p, size);
+    }
+    free(p);
+}
+
+// Borrowed bytes; request arguments point into rbuf while a command runs.
+struct Slice
+{
+    const uint8_t* data;
+    size_t size;
+};
+
+struct Entry;
+
+// Each shard thread owns its own keyspace; single-threaded mode is shard 0.
+static thread_local struct
 {
     Hash_Map db;
+    Swiss_Map swiss;
+    // Scratch reused by every request so the hot path does not allocate.
+    std::vector<Slice> cmd;
+    std::vector<Entry*> scan;
+    std::vector<ZMember> members;
+    // Connection whose wbuf the running command writes into; NULL when the
+    // reply goes to another shard and must not reference local entries.
+    Connection* responder;
 } g_data;
 
+/*
+ * Shard-per-core mode: every thread runs its own event loop on its own
+ * SO_REUSEPORT listener and owns the keys with shard_of(hcode) == id.
+ * Requests for keys owned elsewhere travel to the owner as a Shard_Msg over
+ * its lock-free queue and come back on the sender's queue with `out` filled.
+ */
+struct Shard_Msg
+{
+    Mpsc_Node node;
+    Connection* connection;
+    uint32_t src;
+    Shard_Msg* next;
+    std::string req;
+    Buffer out;
+};
+
+struct Shard
+{
+    Mpsc_Queue queue;
+    uint32_t id;
+    int event_fd;
+    pthread_t thread;
+    bool notify[MAX_SHARDS];
+};
+
+static struct
+{
+    Shard* shards;
+    uint32_t nshards;
+} g_shards;
+
+// NULL unless the server runs in shard-per-core mode.
+static thread_local Shard* g_shard;
+
+static inline uint32_t shard_of(const uint64_t hcode)
+{
+    // Mix first: the low bits of hcode also pick the bucket inside a shard.
+    const uint64_t mixed = hcode * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(((mixed >> 32) * g_shards.nshards) >> 32);
+}
+
+/*
+ * One variable-size allocation per key: the node and lengths, then the key
+ * bytes, then the value bytes. Values over ENTRY_INLINE_MAX are kept in a
+ * block of their own and only a pointer to it follows the key, so a SET of
+ * a big value can resize that block in place. A value that is a canonical
+ * integer is kept as an int64 instead, and only printed when read. A sorted
+ * set lives in a ZSet of its own, pointed to like a spilled value.
+ * The map holds one reference; every reply still sending the value holds
+ * another, so the value never changes under a send in flight.
+ */
 struct Entry
 {
     struct Hash_Node node;
-    std::string key;
-    std::string value;
+    uint32_t refs;
+    uint32_t key_len;
+    // Of a string value; 0 for ENTRY_INT and ENTRY_ZSET.
+    uint32_t value_len;
+    uint8_t type;
+    uint8_t data[];
+};
+
+static inline const uint8_t* entry_key(const Entry* entry)
+{
+    return entry->data;
+}
+
+static inline bool entry_spilled(const Entry* entry)
+{
+    return entry->value_len > ENTRY_INLINE_MAX;
+}
+
+static inline size_t entry_alloc_size(const size_t key_len, const uint8_t type, const size_t value_len)
+{
+    size_t value_bytes = value_len;
+    if (type == ENTRY_INT) {
+        value_bytes = sizeof(int64_t);
+    } else if (type == ENTRY_ZSET) {
+        value_bytes = sizeof(ZSet *);
+    } else if (value_len > ENTRY_INLINE_MAX) {
+        value_bytes = sizeof(uint8_t *);
+    }
+    return offsetof(Entry, data) + key_len + value_bytes;
+}
+
+static inline const uint8_t* entry_value(const Entry* entry)
+{
+    const uint8_t* p = &entry->data[entry->key_len];
+    if (!entry_spilled(entry)) {
+        return p;
+    }
+    const uint8_t* value = NULL;
+    // Right after the key, so not necessarily aligned.
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline int64_t entry_int(const Entry* entry)
+{
+    int64_t value = 0;
+    memcpy(&value, &entry->data[entry->key_len], sizeof(value));
+    return value;
+}
+
+static inline void entry_set_int(Entry* entry, const int64_t value)
+{
+    memcpy(&entry->data[entry->key_len], &value, sizeof(value));
+}
+
+static inline ZSet* entry_zset(const Entry* entry)
+{
+    ZSet* zset = NULL;
+    memcpy(&zset, &entry->data[entry->key_len], sizeof(zset));
+    return zset;
+}
+
+// The bytes of the entry's value go out right before wbuf[pos].
+struct Out_Ref
+{
+    Out_Ref* next;
+    size_t pos;
+    Entry* entry;
 };
 
-static bool entry_eq(Hash_Node* lhs, Hash_Node* rhs)
+static inline void entry_unref(Entry* entry)
 {
-    struct Entry* le = CONTAINER_OF(lhs, struct Entry, node);
-    struct Entry* re = CONTAINER_OF(rhs, struct Entry, node);
-    return le->key == re->key;
+    assert(entry->refs > 0);
+    if (--entry->refs == 0) {
+        if (entry_spilled(entry)) {
+            free((void*)entry_value(entry));
+        } else if (entry->type == ENTRY_ZSET) {
+            ZSet* zset = entry_zset(entry);
+            zset_clear(zset);
+            free(zset);
+        }
+        obj_free(entry, entry_alloc_size(entry->key_len, entry->type, entry->value_len));
+    }
 }
 
-static uint64_t str_hash(const uint8_t* data, const size_t len)
+// Search key that borrows the request bytes instead of building an Entry.
+struct Lookup_Key
 {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; ++i) {
-        h = (h + data[i]) * 0x01000193;
+    struct Hash_Node node;
+    Slice key;
+};
+
+struct Entry_Traits
+{
+    static inline bool eq(const Entry* entry, const Slice& key)
+    {
+        return entry->key_len == key.size && 0 == memcmp(entry_key(entry), key.data, key.size);
     }
-    return h;
+};
+
+// The chained keyspace, searched straight by the request's key bytes.
+typedef Hash_Map_T<Entry, Slice, Entry_Traits> Entry_Map;
+
+// The Swiss table still takes a node and a callback.
+static bool entry_eq_key(Hash_Node* lhs, Hash_Node* rhs)
+{
+    struct Entry* entry = CONTAINER_OF(lhs, struct Entry, node);
+    struct Lookup_Key* key = CONTAINER_OF(rhs, struct Lookup_Key, node);
+    return entry->key_len == key->key.size
+        && 0 == memcmp(entry_key(entry), key->key.data, key->key.size);
 }
 
 static inline void msg(const char* msg)
@@ -106,6 +365,13 @@ static inline void die(const char* msg)
     abort();
 }
 
+static inline uint64_t get_monotonic_msec()
+{
+    struct timespec tv = {};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_nsec / 1000000;
+}
+
 static inline void fd_set_nb(const int fd)
 {
     errno = 0;
@@ -120,38 +386,95 @@ static inline void fd_set_nb(const int fd)
     }
 }
 
-static inline void out_nil(std::string& out)
+/*
+ * Serializers append straight to the output buffer, normally the
+ * connection's wbuf, so a value is copied once: from the Entry into wbuf.
+ */
+static inline void out_type(Buffer* out, const uint8_t type)
+{
+    buf_append(out, &type, 1);
+}
+
+static inline void out_nil(Buffer* out)
+{
+    out_type(out, SER_NIL);
+}
+
+static inline void out_str(Buffer* out, const char* data, const size_t size)
+{
+    out_type(out, SER_STR);
+    const uint32_t len = (uint32_t)size;
+    buf_append(out, &len, HEADER_SIZE);
+    buf_append(out, data, size);
+}
+
+static inline void out_str(Buffer* out, const std::string& value)
+{
+    out_str(out, value.data(), value.size());
+}
+
+static inline void out_int(Buffer* out, const int64_t value)
+{
+    out_type(out, SER_INT);
+    buf_append(out, &value, sizeof(value));
+}
+
+static inline void out_dbl(Buffer* out, const double value)
+{
+    out_type(out, SER_DBL);
+    buf_append(out, &value, sizeof(value));
+}
+
+static inline void out_err(Buffer* out, const int32_t code, const char* msg)
 {
-    out.push_back(SER_NIL);
+    out_type(out, SER_ERR);
+    buf_append(out, &code, HEADER_SIZE);
+    const uint32_t len = (uint32_t)strlen(msg);
+    buf_append(out, &len, HEADER_SIZE);
+    buf_append(out, msg, len);
 }
 
-static inline void out_str(std::string& out, const std::string& value)
+static inline void out_arr(Buffer* out, const uint32_t n)
 {
-    out.push_back(SER_STR);
-    const uint32_t len = (uint32_t)value.size();
-    out.append((char*)&len, HEADER_SIZE);
-    out.append(value);
+    out_type(out, SER_ARR);
+    buf_append(out, &n, HEADER_SIZE);
 }
 
-static inline void out_int(std::string& out, const int64_t value)
+// Queues the value as a reference to the pinned entry instead of a copy.
+static void out_str_ref(Connection* connection, Entry* entry)
 {
-    out.push_back(SER_INT);
-    out.append((char*)value, HEADER_SIZE);
+    Out_Ref* ref = (Out_Ref*)malloc(sizeof(Out_Ref));
+    if (NULL == ref) {
+        return out_str(&connection->wbuf, (const char*)entry_value(entry), entry->value_len);
+    }
+    const uint32_t len = entry->value_len;
+    out_type(&connection->wbuf, SER_STR);
+    buf_append(&connection->wbuf, &len, HEADER_SIZE);
+    ref->next = NULL;
+    ref->pos = connection->wbuf.size;
+    ref->entry = entry;
+    ++entry->refs;
+    if (connection->refs_tail != NULL) {
+        connection->refs_tail->next = ref;
+    } else {
+        connection->refs = ref;
+    }
+    connection->refs_tail = ref;
+    connection->ref_bytes += len;
 }
 
-static inline void out_err(std::string& out, const int32_t code, const std::string& msg)
+// For arrays whose length is known only at the end: reserves the length
+// and returns where it is, to be filled in by out_end_arr.
+static inline size_t out_begin_arr(Buffer* out)
 {
-    out.push_back(SER_ERR);
-    out.append((char*)&code, HEADER_SIZE);
-    const uint32_t len = (uint32_t)msg.size();
-    out.append((char*)&len, HEADER_SIZE);
-    out.append(msg);
+    out_arr(out, 0);
+    return out->size - HEADER_SIZE;
 }
 
-static inline void out_arr(std::string& out, const uint32_t n)
+static inline void out_end_arr(Buffer* out, const size_t pos, const uint32_t n)
 {
-    out.push_back(SER_ARR);
-    out.append((char*)&n, HEADER_SIZE);
+    assert(out->data[pos - 1] == SER_ARR);
+    memcpy(&out->data[pos], &n, HEADER_SIZE);
 }
 
 static inline void connection_put(std::vector<Connection*>& fd2connection, struct Connection* connection)
@@ -162,41 +485,117 @@ static inline void connection_put(std::vector<Connection*>& fd2connection, struc
     fd2connection[connection->fd] = connection;
 }
 
-static inline size_t accept_new_connection(std::vector<Connection*>& fd2connection, const int fd)
+// Idle peers are shut down rather than freed here, so every backend tears
+// the connection down on its usual EOF path.
+static void connection_idle(Timer* timer)
 {
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    const int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-    if (connfd < 0) {
-        msg("accept() error");
-        return -1;
+    Connection* connection = CONTAINER_OF(timer, struct Connection, idle_timer);
+    (void)shutdown(connection->fd, SHUT_RDWR);
+}
+
+static inline void connection_touch(Timer_Wheel* timers, Connection* connection)
+{
+    if (g_config.idle_timeout_ms > 0) {
+        tw_add(timers, &connection->idle_timer, timers->now + g_config.idle_timeout_ms);
     }
-    fd_set_nb(connfd);
-    struct Connection* connection = (struct Connection*)malloc(sizeof(struct Connection));
+}
+
+// Periodic per-thread release of empty slabs, so the memory of a past peak
+// goes back to the OS instead of staying mapped for good.
+struct Slab_Release
+{
+    Timer timer;
+    Timer_Wheel* timers;
+};
+
+static void slab_release_expire(Timer* timer)
+{
+    Slab_Release* release = CONTAINER_OF(timer, struct Slab_Release, timer);
+    (void)slab_release_empty();
+    tw_add(release->timers, &release->timer, release->timers->now + SLAB_RELEASE_MS);
+}
+
+static inline void slab_release_start(Slab_Release* release, Timer_Wheel* timers)
+{
+    if (g_config.allocator != ALLOC_SLAB) {
+        return;
+    }
+    timer_init(&release->timer, &slab_release_expire);
+    release->timers = timers;
+    tw_add(timers, &release->timer, timers->now + SLAB_RELEASE_MS);
+}
+
+// How long the event loop may block before the timer wheel needs it.
+static inline int loop_timeout(Timer_Wheel* timers)
+{
+    const int64_t timeout = tw_timeout(timers);
+    return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+static inline Connection* connection_new(std::vector<Connection*>& fd2connection, const int connfd)
+{
+    struct Connection* connection = (struct Connection*)obj_alloc(sizeof(struct Connection));
     if (NULL == connection) {
         close(connfd);
-        return -1;
+        return NULL;
     }
     connection->fd = connfd;
     connection->state = STATE_REQ;
-    connection->rbuf_size = 0;
-    connection->wbuf_size = 0;
+    connection->pending = 0;
+    connection->replies = NULL;
+    buf_init(&connection->rbuf);
+    buf_init(&connection->wbuf);
     connection->wbuf_sent = 0;
+    connection->refs = NULL;
+    connection->refs_tail = NULL;
+    connection->ref_bytes = 0;
+    connection->ref_sent = 0;
+    timer_init(&connection->idle_timer, &connection_idle);
     connection_put(fd2connection, connection);
-    return 0;
+    return connection;
+}
+
+static inline Connection* accept_new_connection(std::vector<Connection*>& fd2connection, const int fd)
+{
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    const int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+    if (connfd < 0) {
+        msg("accept() error");
+        return NULL;
+    }
+    fd_set_nb(connfd);
+    return connection_new(fd2connection, connfd);
+}
+
+static inline void connection_done(std::vector<Connection*>& fd2connection, Connection* connection)
+{
+    fd2connection[connection->fd] = NULL;
+    tw_del(&connection->idle_timer);
+    (void)close(connection->fd);
+    buf_free(&connection->rbuf);
+    buf_free(&connection->wbuf);
+    while (connection->refs != NULL) {
+        Out_Ref* ref = connection->refs;
+        connection->refs = ref->next;
+        entry_unref(ref->entry);
+        free(ref);
+    }
+    obj_free(connection, sizeof(struct Connection));
 }
 
 static inline void state_req(Connection* connection);
 static inline void state_res(Connection* connection);
 
-static int32_t parse_req(const uint8_t* data, size_t len, std::vector<std::string>& out)
+// The slices in `out` borrow from `data`.
+static int32_t parse_req(const uint8_t* data, size_t len, std::vector<Slice>& out)
 {
     if (len < HEADER_SIZE) {
         return -1;
     }
     uint32_t n = 0;
     memcpy(&n, &data[0], HEADER_SIZE);
-    if (n > MAX_MESSAGE_SIZE) {
+    if (n > len / HEADER_SIZE) {
         return -1;
     }
 
@@ -210,7 +609,8 @@ static int32_t parse_req(const uint8_t* data, size_t len, std::vector<std::strin
         if (pos + HEADER_SIZE + sz > len) {
             return -1;
         }
-        out.push_back(std::string((char*)&data[pos + HEADER_SIZE], sz));
+        const Slice arg = { &data[pos + HEADER_SIZE], sz };
+        out.push_back(arg);
         pos += HEADER_SIZE + sz;
     }
     if (pos != len) {
@@ -219,251 +619,1389 @@ static int32_t parse_req(const uint8_t* data, size_t len, std::vector<std::strin
     return 0;
 }
 
-static inline void do_get(std::vector<std::string>& cmd, std::string& out)
+static inline Entry* db_lookup(Lookup_Key* key)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    Hash_Node* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (NULL == node) {
-        return out_nil(out);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        Hash_Node* node = sm_lookup(&g_data.swiss, &key->node, &entry_eq_key);
+        return node != NULL ? CONTAINER_OF(node, struct Entry, node) : NULL;
     }
-
-    const std::string& value = CONTAINER_OF(node, struct Entry, node)->value;
-    out_str(out, value);
+    return Entry_Map::lookup(&g_data.db, key->key, key->node.hcode);
 }
 
-static inline void do_set(std::vector<std::string>& cmd, std::string& out)
+static inline void db_prefetch_bucket(const uint64_t hcode)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    Hash_Node* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (NULL != node) {
-        CONTAINER_OF(node, struct Entry, node)->value.swap(cmd[2]);
-    } else {
-        Entry* entry = new Entry;
-        entry->key.swap(key.key);
-        entry->node.hcode = key.node.hcode;
-        entry->value.swap(cmd[2]);
-        hm_insert(&g_data.db, &entry->node);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_prefetch_bucket(&g_data.swiss, hcode);
     }
-    return out_nil(out);
+    hm_prefetch_bucket(&g_data.db, hcode);
 }
 
-static void do_del(std::vector<std::string>& cmd, std::string& out)
+static inline void db_prefetch_node(const uint64_t hcode)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    Hash_Node* node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    if (NULL != node) {
-        delete CONTAINER_OF(node, struct Entry, node);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_prefetch_node(&g_data.swiss, hcode);
     }
-    return out_int(out, node ? 1 : 0);
+    hm_prefetch_node(&g_data.db, hcode);
 }
 
-static inline void h_scan(Hash_Table* table, void (*f)(Hash_Node*, void*), void* arg)
+static inline void db_insert(Entry* entry)
 {
-    if (table->size == 0) {
-        return;
-    }
-    for (size_t i = 0; i < table->mask + 1; ++i) {
-        Hash_Node* node = table->table[i];
-        while (node != NULL) {
-            f(node, arg);
-            node = node->next;
-        }
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_insert(&g_data.swiss, &entry->node);
     }
+    Entry_Map::insert(&g_data.db, entry);
 }
 
-static inline void cb_scan(Hash_Node* node, void* arg)
+static inline Entry* db_pop(Lookup_Key* key)
 {
-    std::string& out = *(std::string *) arg;
-    out_str(out, CONTAINER_OF(node, struct Entry, node)->key);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        Hash_Node* node = sm_pop(&g_data.swiss, &key->node, &entry_eq_key);
+        return node != NULL ? CONTAINER_OF(node, struct Entry, node) : NULL;
+    }
+    return Entry_Map::pop(&g_data.db, key->key, key->node.hcode);
 }
 
-static inline void do_keys(std::vector<std::string>& cmd, std::string& out)
+static inline size_t db_size()
 {
-    (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.table1, &cb_scan, &out);
-    h_scan(&g_data.db.table2, &cb_scan, &out);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_size(&g_data.swiss);
+    }
+    return hm_size(&g_data.db);
 }
 
-static inline bool cmd_is(const std::string& word, const char* cmd)
+static inline size_t db_bucket_bytes()
 {
-    return 0 == strcasecmp(word.c_str(), cmd);
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_bucket_bytes(&g_data.swiss);
+    }
+    return hm_bucket_bytes(&g_data.db);
 }
 
-static void do_request(std::vector<std::string>& cmd, std::string& out)
+static inline void db_foreach(void (*f)(Hash_Node*, void*), void* arg)
 {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        do_keys(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
-        do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "set")) {
-        do_set(cmd, out);
-    } else if(cmd.size() == 2 && cmd_is(cmd[0], "del")) {
-        do_del(cmd, out);
-    } else {
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_foreach(&g_data.swiss, f, arg);
     }
+    hm_foreach(&g_data.db, f, arg);
 }
 
-static bool try_one_request(Connection* connection)
+static inline uint64_t db_scan(const uint64_t cursor, void (*f)(Hash_Node*, void*), void* arg)
 {
-    if (connection->rbuf_size < HEADER_SIZE) {
-        return false;
+    if (g_config.hash_engine == ENGINE_SWISS) {
+        return sm_scan(&g_data.swiss, cursor, f, arg);
     }
+    return hm_scan(&g_data.db, cursor, f, arg);
+}
 
-    uint32_t len = 0;
-    memcpy(&len, &connection->rbuf[0], HEADER_SIZE);
-    if (len > MAX_MESSAGE_SIZE) {
-        msg("too long");
-        connection->state = STATE_END;
-        return false;
+// Accepts only the text GET would print back, so integer encoding never
+// changes what a client reads.
+static bool slice_to_i64(const Slice& slice, int64_t* value)
+{
+    const uint8_t* p = slice.data;
+    size_t n = slice.size;
+    const bool negative = n > 0 && p[0] == '-';
+    if (negative) {
+        ++p;
+        --n;
     }
-    if (HEADER_SIZE + len > connection->rbuf_size) {
+    if (n == 0 || n > 19 || (p[0] == '0' && (n > 1 || negative))) {
         return false;
     }
-
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&connection->rbuf[HEADER_SIZE], len, cmd)) {
-        msg("bad req");
-        connection->state = STATE_END;
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t digit = p[i] - '0';
+        if (digit > 9) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+    if (v > (uint64_t)INT64_MAX + negative) {
         return false;
     }
-    
-    std::string out;
-    do_request(cmd, out);
-    if (HEADER_SIZE + out.size() > MAX_MESSAGE_SIZE) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+    *value = negative ? (int64_t)(0 - v) : (int64_t)v;
+    return true;
+}
+
+// Fills in everything but the value.
+static Entry* entry_alloc(const Slice& key, const uint64_t hcode, const uint8_t type, const size_t value_len)
+{
+    Entry* entry = (Entry*)obj_alloc(entry_alloc_size(key.size, type, value_len));
+    if (NULL == entry) {
+        die("obj_alloc()");
     }
+    entry->node.next = NULL;
+    entry->node.hcode = hcode;
+    entry->refs = 1;
+    entry->key_len = (uint32_t)key.size;
+    entry->value_len = (uint32_t)value_len;
+    entry->type = type;
+    memcpy(entry->data, key.data, key.size);
+    return entry;
+}
 
-    const uint32_t wlen = (uint32_t)out.size();
-    memcpy(&connection->wbuf[0], &wlen, HEADER_SIZE);
-    memcpy(&connection->wbuf[HEADER_SIZE], out.data(), out.size());
-    connection->wbuf_size = HEADER_SIZE + wlen;
+static Entry* entry_new(const Slice& key, const uint64_t hcode, const Slice& value)
+{
+    int64_t number = 0;
+    const bool is_int = slice_to_i64(value, &number);
+    const bool spill = !is_int && value.size > ENTRY_INLINE_MAX;
+    Entry* entry = entry_alloc(key, hcode, is_int ? ENTRY_INT : ENTRY_STR, is_int ? 0 : value.size);
+    if (is_int) {
+        entry_set_int(entry, number);
+        return entry;
+    }
+    if (!spill) {
+        memcpy(&entry->data[key.size], value.data, value.size);
+        return entry;
+    }
+    uint8_t* block = (uint8_t*)malloc(value.size);
+    if (NULL == block) {
+        die("malloc()");
+    }
+    memcpy(block, value.data, value.size);
+    memcpy(&entry->data[key.size], &block, sizeof(block));
+    return entry;
+}
 
-    size_t remain = connection->rbuf_size - HEADER_SIZE - len;
-    if (remain) {
-        memmove(connection->rbuf, &connection->rbuf[HEADER_SIZE + len], remain);
+static Entry* entry_new_zset(const Slice& key, const uint64_t hcode)
+{
+    Entry* entry = entry_alloc(key, hcode, ENTRY_ZSET, 0);
+    ZSet* zset = (ZSet*)malloc(sizeof(ZSet));
+    if (NULL == zset) {
+        die("malloc()");
     }
-    connection->rbuf_size = remain;
-    connection->state = STATE_RES;
-    state_res(connection);
-    return (connection->state = STATE_REQ);
+    zset_init(zset, g_config.zset_engine);
+    memcpy(&entry->data[key.size], &zset, sizeof(zset));
+    return entry;
 }
 
-static inline bool try_full_buffer(Connection* connection)
+// Overwrites the value if the entry's layout allows it; false otherwise.
+static bool entry_set_value(Entry* entry, const Slice& value)
 {
-    assert(connection->rbuf_size < sizeof(connection->rbuf));
-    ssize_t rv = 0;
-    do {
-        const size_t capacity = sizeof(connection->rbuf) - connection->rbuf_size;
-        rv = read(connection->fd, &connection->rbuf[connection->rbuf_size], capacity);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN) {
-        return false;
+    int64_t number = 0;
+    if (slice_to_i64(value, &number)) {
+        if (entry->type != ENTRY_INT) {
+            return false;
+        }
+        entry_set_int(entry, number);
+        return true;
     }
-    if (rv < 0) {
-        msg("read() error");
-        connection->state = STATE_END;
+    if (entry->type != ENTRY_STR) {
         return false;
     }
-    if (0 == rv) {
-        if (connection->rbuf_size > 0) {
-            msg("unexpected EOF");
+    if (!entry_spilled(entry)) {
+        if (value.size != entry->value_len) {
+            return false;
         }
-        connection->state = STATE_END;
+        memcpy(&entry->data[entry->key_len], value.data, value.size);
+        return true;
+    }
+    if (value.size <= ENTRY_INLINE_MAX) {
         return false;
     }
-
-    connection->rbuf_size += (size_t)rv;
-    assert(connection->rbuf_size <= sizeof(connection->rbuf));
-
-    while (try_one_request(connection)) {}
-    return (connection->state == STATE_REQ);
+    uint8_t* block = (uint8_t*)entry_value(entry);
+    if (value.size != entry->value_len) {
+        block = (uint8_t*)realloc(block, value.size);
+        if (NULL == block) {
+            die("realloc()");
+        }
+        memcpy(&entry->data[entry->key_len], &block, sizeof(block));
+        entry->value_len = (uint32_t)value.size;
+    }
+    memcpy(block, value.data, value.size);
+    return true;
 }
 
-static inline void state_req(Connection* connection)
+static inline void lookup_key_init(Lookup_Key* key, const Slice& slice)
 {
-    while (try_full_buffer(connection));
+    key->key = slice;
+    key->node.hcode = hash_bytes(slice.data, slice.size);
 }
 
-static inline bool try_flush_buffer(Connection* connection)
+/*
+ * Looks up the keys cmd[1], cmd[1 + step], ... MULTI_BATCH at a time: hashes
+ * the whole batch and prefetches every bucket, then every first node, then
+ * runs the lookups in order. The cache misses of a batch overlap instead of
+ * each lookup waiting for its own. `f` gets the key, the entry or NULL,
+ * and the key's index in cmd.
+ */
+static void db_lookup_batch(std::vector<Slice>& cmd, const size_t step,
+                            void (*f)(Lookup_Key*, Entry*, size_t, void*), void* arg)
 {
-    ssize_t rv = 0;
-    do {
-        const size_t remain = connection->wbuf_size - connection->wbuf_sent;
-        rv = write(connection->fd, &connection->wbuf[connection->wbuf_sent], remain);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN) {
-        return false;
+    Lookup_Key keys[MULTI_BATCH];
+    for (size_t first = 1; first < cmd.size(); first += MULTI_BATCH * step) {
+        size_t n = 0;
+        for (size_t i = first; i < cmd.size() && n < MULTI_BATCH; i += step) {
+            lookup_key_init(&keys[n], cmd[i]);
+            db_prefetch_bucket(keys[n].node.hcode);
+            ++n;
+        }
+        for (size_t j = 0; j < n; ++j) {
+            db_prefetch_node(keys[j].node.hcode);
+        }
+        for (size_t j = 0; j < n; ++j) {
+            f(&keys[j], db_lookup(&keys[j]), first + j * step, arg);
+        }
     }
-    if (rv < 0){
-        msg("write() error");
-        connection->state = STATE_END;
-        return false;
+}
+
+// Keys of a multi-key command must all live on the shard running it.
+static bool keys_are_local(const std::vector<Slice>& cmd, const size_t step)
+{
+    if (NULL == g_shard) {
+        return true;
     }
-    connection->wbuf_sent += (size_t)rv;
-    assert(connection->wbuf_sent <= connection->wbuf_size);
-    if (connection->wbuf_sent == connection->wbuf_size) {
-        connection->state = STATE_REQ;
-        connection->wbuf_sent = 0;
-        connection->wbuf_size = 0;
-        return false;
+    for (size_t i = 1; i < cmd.size(); i += step) {
+        if (shard_of(hash_bytes(cmd[i].data, cmd[i].size)) != g_shard->id) {
+            return false;
+        }
     }
     return true;
 }
 
-static inline void state_res(Connection* connection)
+static inline void out_wrong_type(Buffer* out)
 {
-    while (try_flush_buffer(connection));
+    out_err(out, ERR_TYPE, "key holds the wrong kind of value");
 }
 
-static inline void connection_io(Connection* connection)
+// MGET reads a sorted set as nil, like a missing key.
+static void out_value(Buffer* out, Entry* entry)
 {
-    if (connection->state == STATE_REQ) {
-        state_req(connection);
-    } else if (connection->state == STATE_RES) {
-        state_res(connection);
+    if (NULL == entry || entry->type == ENTRY_ZSET) {
+        return out_nil(out);
+    }
+    if (entry->type == ENTRY_INT) {
+        char text[24];
+        const int len = snprintf(text, sizeof(text), "%lld", (long long)entry_int(entry));
+        out_str(out, text, (size_t)len);
+    } else if (g_data.responder != NULL && entry->value_len >= ZEROCOPY_MIN_SIZE) {
+        assert(out == &g_data.responder->wbuf);
+        out_str_ref(g_data.responder, entry);
     } else {
-        assert(false);
+        out_str(out, (const char*)entry_value(entry), entry->value_len);
     }
 }
 
-int main()
+static inline void do_get(std::vector<Slice>& cmd, Buffer* out)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
-    }
-
-    const int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("bind()");
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (entry != NULL && entry->type == ENTRY_ZSET) {
+        return out_wrong_type(out);
     }
+    out_value(out, entry);
+}
 
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        die("listen");
+// Request bytes get copied only into stored entries: a new key, or a new value.
+static void db_set(Lookup_Key* key, Entry* entry, const Slice& value)
+{
+    if (NULL != entry) {
+        if (entry->refs == 1 && entry_set_value(entry, value)) {
+            return;
+        }
+        // Either the new value needs another layout, or a reply is still
+        // sending the old one; that reply keeps the old entry alive.
+        db_pop(key);
+        entry_unref(entry);
     }
+    db_insert(entry_new(key->key, key->node.hcode, value));
+}
 
-    std::vector<Connection*> fd2connection;
+static inline void do_set(std::vector<Slice>& cmd, Buffer* out)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    db_set(&key, db_lookup(&key), cmd[2]);
+    return out_nil(out);
+}
 
-    fd_set_nb(fd);
+static void cb_mget(Lookup_Key* key, Entry* entry, size_t i, void* arg)
+{
+    (void)key;
+    (void)i;
+    out_value((Buffer*)arg, entry);
+}
 
+static void do_mget(std::vector<Slice>& cmd, Buffer* out)
+{
+    if (!keys_are_local(cmd, 1)) {
+        return out_err(out, ERR_ARG, "keys belong to different shards");
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 1));
+    db_lookup_batch(cmd, 1, &cb_mget, out);
+}
+
+static void cb_mset(Lookup_Key* key, Entry* entry, size_t i, void* arg)
+{
+    db_set(key, entry, (*(std::vector<Slice>*)arg)[i + 1]);
+}
+
+static void do_mset(std::vector<Slice>& cmd, Buffer* out)
+{
+    if (cmd.size() % 2 == 0) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    if (!keys_are_local(cmd, 2)) {
+        return out_err(out, ERR_ARG, "keys belong to different shards");
+    }
+    db_lookup_batch(cmd, 2, &cb_mset, &cmd);
+    return out_nil(out);
+}
+
+static void do_del(std::vector<Slice>& cmd, Buffer* out)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_pop(&key);
+    if (NULL != entry) {
+        entry_unref(entry);
+    }
+    return out_int(out, entry ? 1 : 0);
+}
+
+// Counters stay int64 in their entry, so an increment neither parses the
+// value nor allocates; only a missing key gets a new entry.
+static void incr_by(std::vector<Slice>& cmd, Buffer* out, const int64_t delta)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (NULL == entry) {
+        static const uint8_t zero = '0';
+        entry = entry_new(cmd[1], key.node.hcode, Slice{ &zero, 1 });
+        entry_set_int(entry, delta);
+        db_insert(entry);
+        return out_int(out, delta);
+    }
+
+    int64_t value = 0;
+    if (entry->type == ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+    if (entry->type != ENTRY_INT) {
+        return out_err(out, ERR_ARG, "value is not an integer");
+    }
+    if (__builtin_add_overflow(entry_int(entry), delta, &value)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    entry_set_int(entry, value);
+    return out_int(out, value);
+}
+
+static void do_incr(std::vector<Slice>& cmd, Buffer* out)
+{
+    incr_by(cmd, out, 1);
+}
+
+static void do_decr(std::vector<Slice>& cmd, Buffer* out)
+{
+    incr_by(cmd, out, -1);
+}
+
+static void do_incrby(std::vector<Slice>& cmd, Buffer* out)
+{
+    int64_t delta = 0;
+    if (!slice_to_i64(cmd[2], &delta)) {
+        return out_err(out, ERR_ARG, "increment is not an integer");
+    }
+    incr_by(cmd, out, delta);
+}
+
+static void do_decrby(std::vector<Slice>& cmd, Buffer* out)
+{
+    int64_t delta = 0;
+    if (!slice_to_i64(cmd[2], &delta)) {
+        return out_err(out, ERR_ARG, "decrement is not an integer");
+    }
+    if (delta == INT64_MIN) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    incr_by(cmd, out, -delta);
+}
+
+static inline void cb_scan(Hash_Node* node, void* arg)
+{
+    const Entry* entry = CONTAINER_OF(node, struct Entry, node);
+    out_str((Buffer*)arg, (const char*)entry_key(entry), entry->key_len);
+}
+
+static inline void do_keys(std::vector<Slice>& cmd, Buffer* out)
+{
+    (void)cmd;
+    out_arr(out, (uint32_t)db_size());
+    db_foreach(&cb_scan, out);
+}
+
+static bool slice_to_u64(const Slice& slice, uint64_t* value)
+{
+    if (slice.size == 0 || slice.size > 20) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < slice.size; ++i) {
+        const uint8_t digit = slice.data[i] - '0';
+        if (digit > 9 || v > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        v = v * 10 + digit;
+    }
+    *value = v;
+    return true;
+}
+
+static inline bool slice_is(const Slice& word, const char* str)
+{
+    return word.size == strlen(str) && 0 == strncasecmp((const char*)word.data, str, word.size);
+}
+
+// Matches a [...] class; `*pos` starts past the '[' and ends past the ']'.
+static bool glob_class(const uint8_t* pattern, const size_t len, size_t* pos, const uint8_t c)
+{
+    size_t i = *pos;
+    bool negate = false;
+    bool match = false;
+    if (i < len && pattern[i] == '^') {
+        negate = true;
+        ++i;
+    }
+    while (i < len && pattern[i] != ']') {
+        if (pattern[i] == '\\' && i + 1 < len) {
+            match |= pattern[i + 1] == c;
+            i += 2;
+        } else if (i + 2 < len && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            uint8_t lo = pattern[i];
+            uint8_t hi = pattern[i + 2];
+            if (lo > hi) {
+                const uint8_t tmp = lo;
+                lo = hi;
+                hi = tmp;
+            }
+            match |= lo <= c && c <= hi;
+            i += 3;
+        } else {
+            match |= pattern[i] == c;
+            ++i;
+        }
+    }
+    *pos = i < len ? i + 1 : i;
+    return match != negate;
+}
+
+// Glob match with *, ?, [...] and \ escapes. A '*' retries from one byte
+// further on mismatch; only the latest '*' needs revisiting.
+static bool glob_match(const uint8_t* pattern, const size_t plen, const uint8_t* str, const size_t slen)
+{
+    size_t p = 0;
+    size_t s = 0;
+    size_t star_p = SIZE_MAX;
+    size_t star_s = 0;
+    while (s < slen) {
+        if (p < plen) {
+            const uint8_t c = pattern[p];
+            if (c == '*') {
+                star_p = ++p;
+                star_s = s;
+                continue;
+            }
+            size_t next = p + 1;
+            bool match = false;
+            if (c == '?') {
+                match = true;
+            } else if (c == '[') {
+                match = glob_class(pattern, plen, &next, str[s]);
+            } else if (c == '\\' && p + 1 < plen) {
+                match = pattern[p + 1] == str[s];
+                ++next;
+            } else {
+                match = c == str[s];
+            }
+            if (match) {
+                p = next;
+                ++s;
+                continue;
+            }
+        }
+        if (star_p == SIZE_MAX) {
+            return false;
+        }
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < plen && pattern[p] == '*') {
+        ++p;
+    }
+    return p == plen;
+}
+
+static inline void cb_scan_collect(Hash_Node* node, void* arg)
+{
+    ((std::vector<Entry*>*)arg)->push_back(CONTAINER_OF(node, struct Entry, node));
+}
+
+/*
+ * SCAN cursor [COUNT n] [MATCH pattern]: replies [next cursor, [keys]].
+ * Stops after about `n` keys were visited, or SCAN_MAX_WORK * n buckets,
+ * so each call is short whatever the keyspace. MATCH filters the visited
+ * keys, so a call may return fewer than `n`, or none, before cursor 0.
+ * In shard mode the cursor names the shard it scans and moves on to the
+ * next one when that shard is done.
+ */
+static void do_scan(std::vector<Slice>& cmd, Buffer* out)
+{
+    uint64_t cursor = 0;
+    if (!slice_to_u64(cmd[1], &cursor)) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    uint64_t count = SCAN_DEFAULT_COUNT;
+    const Slice* pattern = NULL;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (i + 1 < cmd.size() && slice_is(cmd[i], "count")) {
+            if (!slice_to_u64(cmd[i + 1], &count) || count == 0 || count > UINT32_MAX) {
+                return out_err(out, ERR_ARG, "invalid count");
+            }
+        } else if (i + 1 < cmd.size() && slice_is(cmd[i], "match")) {
+            pattern = &cmd[i + 1];
+        } else {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+    }
+
+    const uint32_t shard = g_shard != NULL ? g_shard->id : 0;
+    const uint32_t nshards = g_shard != NULL ? g_shards.nshards : 1;
+    if ((cursor & ((1u << SCAN_SHARD_BITS) - 1)) != shard) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    cursor >>= SCAN_SHARD_BITS;
+
+    std::vector<Entry*>& found = g_data.scan;
+    found.clear();
+    uint64_t work = count * SCAN_MAX_WORK;
+    do {
+        cursor = db_scan(cursor, &cb_scan_collect, &found);
+    } while (cursor != 0 && found.size() < count && --work > 0);
+
+    uint64_t next = 0;
+    if (cursor != 0) {
+        next = (cursor << SCAN_SHARD_BITS) | shard;
+    } else if (shard + 1 < nshards) {
+        next = shard + 1;
+    }
+    char text[24];
+    const int len = snprintf(text, sizeof(text), "%llu", (unsigned long long)next);
+    out_arr(out, 2);
+    out_str(out, text, (size_t)len);
+    uint32_t n = 0;
+    const size_t pos = out_begin_arr(out);
+    for (Entry* entry : found) {
+        const uint8_t* key = entry_key(entry);
+        if (pattern == NULL || glob_match(pattern->data, pattern->size, key, entry->key_len)) {
+            out_str(out, (const char*)key, entry->key_len);
+            ++n;
+        }
+    }
+    out_end_arr(out, pos, n);
+}
+
+// Like strtod over the whole slice, without NaN.
+static bool slice_to_double(const Slice& slice, double* value)
+{
+    char text[64];
+    if (slice.size == 0 || slice.size >= sizeof(text)) {
+        return false;
+    }
+    memcpy(text, slice.data, slice.size);
+    text[slice.size] = '\0';
+    char* end = NULL;
+    *value = strtod(text, &end);
+    return end == &text[slice.size] && !isnan(*value);
+}
+
+/*
+ * Sorted sets. A write that leaves a set empty deletes its key, so every
+ * ENTRY_ZSET in the keyspace has members.
+ */
+static void do_zadd(std::vector<Slice>& cmd, Buffer* out)
+{
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    std::vector<ZMember>& members = g_data.members;
+    members.clear();
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        ZMember member = { (const char*)cmd[i + 1].data, cmd[i + 1].size, 0 };
+        if (!slice_to_double(cmd[i], &member.score)) {
+            return out_err(out, ERR_ARG, "score is not a valid float");
+        }
+        members.push_back(member);
+    }
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (NULL == entry) {
+        entry = entry_new_zset(cmd[1], key.node.hcode);
+        db_insert(entry);
+    } else if (entry->type != ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+    const size_t added = zset_insert_many(entry_zset(entry), members.data(), members.size());
+    return out_int(out, (int64_t)added);
+}
+
+static void do_zrem(std::vector<Slice>& cmd, Buffer* out)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (NULL == entry) {
+        return out_int(out, 0);
+    }
+    if (entry->type != ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+    ZSet* zset = entry_zset(entry);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        removed += zset_delete(zset, (const char*)cmd[i].data, cmd[i].size);
+    }
+    if (zset_size(zset) == 0) {
+        db_pop(&key);
+        entry_unref(entry);
+    }
+    return out_int(out, removed);
+}
+
+// The member cmd[2] of the sorted set at cmd[1]. NULL with the reply
+// written if the key holds another type, or NULL alone if it is missing.
+static ZNode* zset_member(std::vector<Slice>& cmd, Buffer* out, ZSet** zset, bool* replied)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    *replied = false;
+    if (NULL == entry) {
+        return NULL;
+    }
+    if (entry->type != ENTRY_ZSET) {
+        *replied = true;
+        out_wrong_type(out);
+        return NULL;
+    }
+    *zset = entry_zset(entry);
+    return zset_lookup(*zset, (const char*)cmd[2].data, cmd[2].size);
+}
+
+static void do_zscore(std::vector<Slice>& cmd, Buffer* out)
+{
+    ZSet* zset = NULL;
+    bool replied = false;
+    ZNode* node = zset_member(cmd, out, &zset, &replied);
+    if (replied) {
+        return;
+    }
+    return node != NULL ? out_dbl(out, node->score) : out_nil(out);
+}
+
+static void do_zrank(std::vector<Slice>& cmd, Buffer* out)
+{
+    ZSet* zset = NULL;
+    bool replied = false;
+    ZNode* node = zset_member(cmd, out, &zset, &replied);
+    if (replied) {
+        return;
+    }
+    return node != NULL ? out_int(out, (int64_t)zset_rank(zset, node)) : out_nil(out);
+}
+
+static void do_zcard(std::vector<Slice>& cmd, Buffer* out)
+{
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (entry != NULL && entry->type != ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+    return out_int(out, entry != NULL ? (int64_t)zset_size(entry_zset(entry)) : 0);
+}
+
+/*
+ * ZRANGE key start stop [WITHSCORES]: members by rank, both ends included;
+ * negative ranks count from the end. Finds `start` by subtree counts and
+ * steps in order from there, so the cost is O(log n) plus the reply.
+ */
+static void do_zrange(std::vector<Slice>& cmd, Buffer* out)
+{
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (!slice_to_i64(cmd[2], &start) || !slice_to_i64(cmd[3], &stop)) {
+        return out_err(out, ERR_ARG, "value is not an integer");
+    }
+    bool with_scores = false;
+    if (cmd.size() == 5 && slice_is(cmd[4], "withscores")) {
+        with_scores = true;
+    } else if (cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "syntax error");
+    }
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (NULL == entry) {
+        return out_arr(out, 0);
+    }
+    if (entry->type != ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+
+    ZSet* zset = entry_zset(entry);
+    const int64_t size = (int64_t)zset_size(zset);
+    if (start < 0) {
+        start = start < -size ? 0 : start + size;
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    if (stop >= size) {
+        stop = size - 1;
+    }
+    if (start > stop) {
+        return out_arr(out, 0);
+    }
+    const uint32_t n = (uint32_t)(stop - start + 1);
+    out_arr(out, with_scores ? 2 * n : n);
+    ZIter it;
+    zset_at(zset, (size_t)start, &it);
+    for (uint32_t i = 0; i < n; ++i, zset_next(zset, &it)) {
+        out_str(out, it.node->name, it.node->len);
+        if (with_scores) {
+            out_dbl(out, it.node->score);
+        }
+    }
+}
+
+/*
+ * ZQUERY key score name offset limit: up to `limit` members with their
+ * scores, starting `offset` places after the first member at or after
+ * (score, name). Both the seek and the skip are O(log n), so deep pages
+ * cost no more than the first one.
+ */
+static void do_zquery(std::vector<Slice>& cmd, Buffer* out)
+{
+    double score = 0;
+    if (!slice_to_double(cmd[2], &score)) {
+        return out_err(out, ERR_ARG, "score is not a valid float");
+    }
+    int64_t offset = 0;
+    int64_t limit = 0;
+    if (!slice_to_i64(cmd[4], &offset) || !slice_to_i64(cmd[5], &limit)) {
+        return out_err(out, ERR_ARG, "value is not an integer");
+    }
+    if (limit < 0) {
+        return out_err(out, ERR_ARG, "limit is negative");
+    }
+    Lookup_Key key;
+    lookup_key_init(&key, cmd[1]);
+    Entry* entry = db_lookup(&key);
+    if (NULL == entry) {
+        return out_arr(out, 0);
+    }
+    if (entry->type != ENTRY_ZSET) {
+        return out_wrong_type(out);
+    }
+
+    ZSet* zset = entry_zset(entry);
+    ZIter it;
+    if (zset_seekge(zset, score, (const char*)cmd[3].data, cmd[3].size, &it) && offset != 0) {
+        zset_offset(zset, &it, offset);
+    }
+    uint64_t count = 0;
+    const size_t pos = out_begin_arr(out);
+    for (bool more = it.node != NULL; more && count < (uint64_t)limit; more = zset_next(zset, &it)) {
+        out_str(out, it.node->name, it.node->len);
+        out_dbl(out, it.node->score);
+        ++count;
+    }
+    out_end_arr(out, pos, (uint32_t)(2 * count));
+}
+
+static inline void do_info(std::vector<Slice>& cmd, Buffer* out)
+{
+    (void)cmd;
+    char info[4096];
+    size_t n = (size_t)snprintf(info, sizeof(info),
+             "buffer_bytes_in_use:%zu\n"
+             "buffer_bytes_pooled:%zu\n"
+             "keyspace_keys:%zu\n"
+             "keyspace_bucket_bytes:%zu\n"
+             "slab_bytes_mapped:%zu\n",
+             buf_bytes_in_use(), buf_bytes_pooled(), db_size(), db_bucket_bytes(), slab_bytes_mapped());
+    // The slabs of this thread, by size class; fill counts slabs up to 1/4,
+    // 1/2, 3/4 and fully occupied.
+    for (size_t cls = 0; cls < slab_num_classes() && n < sizeof(info); ++cls) {
+        Slab_Stats stats;
+        slab_stats(cls, &stats);
+        if (stats.slabs > 0) {
+            n += (size_t)snprintf(&info[n], sizeof(info) - n,
+                                  "slab_%zu:slabs=%zu,empty=%zu,used=%zu,capacity=%zu,fill=%zu/%zu/%zu/%zu\n",
+                                  stats.object_size, stats.slabs, stats.empty, stats.used, stats.capacity,
+                                  stats.fill[0], stats.fill[1], stats.fill[2], stats.fill[3]);
+        }
+    }
+    out_str(out, info, n < sizeof(info) ? n : sizeof(info) - 1);
+}
+
+enum
+{
+    CMD_READONLY = 1 << 0,
+    CMD_WRITE    = 1 << 1,
+    // cmd[1] is a key; the command runs on the shard owning it.
+    CMD_KEYED    = 1 << 2,
+    // Runs on every shard; the array replies are concatenated.
+    CMD_FANOUT   = 1 << 3,
+    // cmd[1] is a SCAN cursor; the command runs on the shard it names.
+    CMD_CURSOR   = 1 << 4,
+};
+
+struct Command
+{
+    const char* name;
+    // Argument count including the name; -N means at least N.
+    int32_t arity;
+    uint32_t flags;
+    void (*handler)(std::vector<Slice>& cmd, Buffer* out);
+};
+
+// Indices into g_commands, which must list the commands in this order.
+enum
+{
+    CMD_GET,
+    CMD_SET,
+    CMD_DEL,
+    CMD_KEYS,
+    CMD_INFO,
+    CMD_SCAN,
+    CMD_INCR,
+    CMD_DECR,
+    CMD_INCRBY,
+    CMD_DECRBY,
+    CMD_MGET,
+    CMD_MSET,
+    CMD_ZADD,
+    CMD_ZREM,
+    CMD_ZSCORE,
+    CMD_ZRANK,
+    CMD_ZCARD,
+    CMD_ZRANGE,
+    CMD_ZQUERY,
+    CMD_COUNT
+};
+
+static const Command g_commands[] = {
+    { "get",    2, CMD_READONLY | CMD_KEYED,  &do_get },
+    { "set",    3, CMD_WRITE | CMD_KEYED,     &do_set },
+    { "del",    2, CMD_WRITE | CMD_KEYED,     &do_del },
+    { "keys",   1, CMD_READONLY | CMD_FANOUT, &do_keys },
+    { "info",   1, CMD_READONLY,              &do_info },
+    { "scan",  -2, CMD_READONLY | CMD_CURSOR, &do_scan },
+    { "incr",   2, CMD_WRITE | CMD_KEYED,     &do_incr },
+    { "decr",   2, CMD_WRITE | CMD_KEYED,     &do_decr },
+    { "incrby", 3, CMD_WRITE | CMD_KEYED,     &do_incrby },
+    { "decrby", 3, CMD_WRITE | CMD_KEYED,     &do_decrby },
+    { "mget",  -2, CMD_READONLY | CMD_KEYED,  &do_mget },
+    { "mset",  -3, CMD_WRITE | CMD_KEYED,     &do_mset },
+    { "zadd",  -4, CMD_WRITE | CMD_KEYED,     &do_zadd },
+    { "zrem",  -3, CMD_WRITE | CMD_KEYED,     &do_zrem },
+    { "zscore", 3, CMD_READONLY | CMD_KEYED,  &do_zscore },
+    { "zrank",  3, CMD_READONLY | CMD_KEYED,  &do_zrank },
+    { "zcard",  2, CMD_READONLY | CMD_KEYED,  &do_zcard },
+    { "zrange", -4, CMD_READONLY | CMD_KEYED, &do_zrange },
+    { "zquery", 6, CMD_READONLY | CMD_KEYED,  &do_zquery },
+};
+static_assert(sizeof(g_commands) / sizeof(g_commands[0]) == CMD_COUNT, "g_commands out of sync");
+static_assert(MAX_SHARDS <= (1 << SCAN_SHARD_BITS), "SCAN cursors cannot name every shard");
+
+// Picks the only candidate by length and first letter, then confirms it
+// with one compare; the cost does not grow with the number of commands.
+static const Command* command_lookup(const std::vector<Slice>& cmd)
+{
+    if (cmd.empty() || cmd[0].size == 0) {
+        return NULL;
+    }
+    const Slice& name = cmd[0];
+    int index = -1;
+    switch (name.size) {
+    case 3:
+        switch (name.data[0] | 0x20) {
+        case 'g': index = CMD_GET; break;
+        case 's': index = CMD_SET; break;
+        case 'd': index = CMD_DEL; break;
+        }
+        break;
+    case 4:
+        switch (name.data[0] | 0x20) {
+        case 'k': index = CMD_KEYS; break;
+        case 'i': index = (name.data[2] | 0x20) == 'f' ? CMD_INFO : CMD_INCR; break;
+        case 's': index = CMD_SCAN; break;
+        case 'd': index = CMD_DECR; break;
+        case 'm': index = (name.data[1] | 0x20) == 'g' ? CMD_MGET : CMD_MSET; break;
+        case 'z': index = (name.data[1] | 0x20) == 'a' ? CMD_ZADD : CMD_ZREM; break;
+        }
+        break;
+    case 5:
+        switch (name.data[0] | 0x20) {
+        case 'z': index = (name.data[1] | 0x20) == 'r' ? CMD_ZRANK : CMD_ZCARD; break;
+        }
+        break;
+    case 6:
+        switch (name.data[0] | 0x20) {
+        case 'i': index = CMD_INCRBY; break;
+        case 'd': index = CMD_DECRBY; break;
+        case 'z':
+            switch (name.data[1] | 0x20) {
+            case 's': index = CMD_ZSCORE; break;
+            case 'r': index = CMD_ZRANGE; break;
+            case 'q': index = CMD_ZQUERY; break;
+            }
+            break;
+        }
+        break;
+    }
+    if (index < 0 || 0 != strncasecmp((const char*)name.data, g_commands[index].name, name.size)) {
+        return NULL;
+    }
+    return &g_commands[index];
+}
+
+static inline bool command_arity_ok(const Command* command, const size_t argc)
+{
+    return command->arity >= 0 ? argc == (size_t)command->arity : argc >= (size_t)-command->arity;
+}
+
+static void do_request(std::vector<Slice>& cmd, Buffer* out)
+{
+    const Command* command = command_lookup(cmd);
+    if (NULL == command) {
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    } else if (!command_arity_ok(command, cmd.size())) {
+        out_err(out, ERR_ARG, "wrong number of arguments");
+    } else {
+        command->handler(cmd, out);
+    }
+}
+
+static inline void shard_send(const uint32_t dst, Shard_Msg* shard_msg)
+{
+    mpsc_push(&g_shards.shards[dst].queue, &shard_msg->node);
+    g_shard->notify[dst] = true;
+}
+
+// Forwarded requests carry a copy of the raw request; rbuf moves on.
+static inline Shard_Msg* shard_msg_new(Connection* connection, const uint8_t* req, const size_t len)
+{
+    Shard_Msg* shard_msg = new Shard_Msg;
+    shard_msg->connection = connection;
+    shard_msg->src = g_shard->id;
+    shard_msg->next = NULL;
+    shard_msg->req.assign((const char*)req, len);
+    buf_init(&shard_msg->out);
+    return shard_msg;
+}
+
+static inline void shard_msg_free(Shard_Msg* shard_msg)
+{
+    buf_free(&shard_msg->out);
+    delete shard_msg;
+}
+
+static inline void shard_execute(Shard_Msg* shard_msg)
+{
+    std::vector<Slice>& cmd = g_data.cmd;
+    cmd.clear();
+    const int32_t rv = parse_req((const uint8_t*)shard_msg->req.data(), shard_msg->req.size(), cmd);
+    assert(rv == 0);
+    (void)rv;
+    do_request(cmd, &shard_msg->out);
+}
+
+// Returns true if the request was handed to other shards.
+static bool shard_forward(Connection* connection, std::vector<Slice>& cmd, const uint8_t* req, const size_t len)
+{
+    const Command* command = command_lookup(cmd);
+    if (NULL == command || !command_arity_ok(command, cmd.size())) {
+        return false;
+    }
+    if (command->flags & CMD_FANOUT) {
+        // Fan out; the local part is gathered like any other reply.
+        for (uint32_t i = 0; i < g_shards.nshards; ++i) {
+            if (i != g_shard->id) {
+                shard_send(i, shard_msg_new(connection, req, len));
+            }
+        }
+        Shard_Msg* local = shard_msg_new(connection, req, len);
+        command->handler(cmd, &local->out);
+        connection->replies = local;
+        connection->pending = g_shards.nshards - 1;
+        return connection->pending > 0;
+    }
+    uint32_t owner = g_shard->id;
+    if (command->flags & CMD_KEYED) {
+        owner = shard_of(hash_bytes(cmd[1].data, cmd[1].size));
+    } else if (command->flags & CMD_CURSOR) {
+        uint64_t cursor = 0;
+        if (slice_to_u64(cmd[1], &cursor)) {
+            owner = (uint32_t)(cursor & ((1u << SCAN_SHARD_BITS) - 1));
+        }
+        if (owner >= g_shards.nshards) {
+            // Let the local shard reject it.
+            return false;
+        }
+    }
+    if (owner == g_shard->id) {
+        return false;
+    }
+    shard_send(owner, shard_msg_new(connection, req, len));
+    connection->pending = 1;
+    return true;
+}
+
+// Combines the replies of a forwarded request, then frees them; only KEYS
+// has several.
+static inline void shard_gather(Connection* connection, Buffer* out)
+{
+    Shard_Msg* replies = connection->replies;
+    connection->replies = NULL;
+    if (replies->next == NULL) {
+        buf_append(out, replies->out.data, replies->out.size);
+        shard_msg_free(replies);
+        return;
+    }
+    uint32_t n = 0;
+    const size_t pos = out_begin_arr(out);
+    while (replies != NULL) {
+        Shard_Msg* reply = replies;
+        replies = reply->next;
+        assert(reply->out.size >= 1 + HEADER_SIZE && reply->out.data[0] == SER_ARR);
+        uint32_t len = 0;
+        memcpy(&len, &reply->out.data[1], HEADER_SIZE);
+        n += len;
+        buf_append(out, &reply->out.data[1 + HEADER_SIZE], reply->out.size - 1 - HEADER_SIZE);
+        shard_msg_free(reply);
+    }
+    out_end_arr(out, pos, n);
+}
+
+struct Frame
+{
+    size_t start;
+    size_t ref_bytes;
+};
+
+// Opens a response frame behind the ones already queued in wbuf; the
+// response is serialized in place and respond_end fills in its length.
+static inline Frame respond_begin(Connection* connection)
+{
+    const uint32_t wlen = 0;
+    buf_append(&connection->wbuf, &wlen, HEADER_SIZE);
+    const Frame frame = { connection->wbuf.size, connection->ref_bytes };
+    return frame;
+}
+
+// Unpins the values queued at or after wbuf[pos].
+static void connection_drop_refs(Connection* connection, const size_t pos)
+{
+    Out_Ref** from = &connection->refs;
+    connection->refs_tail = NULL;
+    while (*from != NULL && (*from)->pos < pos) {
+        connection->refs_tail = *from;
+        from = &(*from)->next;
+    }
+    while (*from != NULL) {
+        Out_Ref* ref = *from;
+        *from = ref->next;
+        connection->ref_bytes -= ref->entry->value_len;
+        entry_unref(ref->entry);
+        free(ref);
+    }
+}
+
+static inline void respond_end(Connection* connection, const Frame frame)
+{
+    Buffer* out = &connection->wbuf;
+    size_t len = out->size - frame.start + connection->ref_bytes - frame.ref_bytes;
+    if (len > g_config.max_message_size) {
+        connection_drop_refs(connection, frame.start);
+        buf_truncate(out, frame.start);
+        out_err(out, ERR_2BIG, "response is too big");
+        len = out->size - frame.start;
+    }
+    const uint32_t wlen = (uint32_t)len;
+    memcpy(&out->data[frame.start - HEADER_SIZE], &wlen, HEADER_SIZE);
+}
+
+// Executes one buffered request and queues its response in wbuf; no I/O.
+// Stops once a batch worth of responses is queued.
+static bool handle_one_request(Connection* connection)
+{
+    if (connection->rbuf.size < HEADER_SIZE) {
+        return false;
+    }
+    if (connection->wbuf.size + connection->ref_bytes >= WBUF_BATCH_SIZE) {
+        return false;
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, &connection->rbuf.data[0], HEADER_SIZE);
+    if (len > g_config.max_message_size) {
+        msg("too long");
+        connection->state = STATE_END;
+        return false;
+    }
+    if (HEADER_SIZE + len > connection->rbuf.size) {
+        return false;
+    }
+
+    const uint8_t* req = &connection->rbuf.data[HEADER_SIZE];
+    std::vector<Slice>& cmd = g_data.cmd;
+    cmd.clear();
+    if (0 != parse_req(req, len, cmd)) {
+        msg("bad req");
+        connection->state = STATE_END;
+        return false;
+    }
+
+    if (g_shard != NULL && shard_forward(connection, cmd, req, len)) {
+        buf_consume(&connection->rbuf, HEADER_SIZE + len);
+        connection->state = STATE_WAIT;
+        return false;
+    }
+
+    const Frame frame = respond_begin(connection);
+    if (connection->replies != NULL) {
+        shard_gather(connection, &connection->wbuf);
+    } else {
+        g_data.responder = connection;
+        do_request(cmd, &connection->wbuf);
+        g_data.responder = NULL;
+    }
+    respond_end(connection, frame);
+    // The arguments borrowed from rbuf are dead only now.
+    buf_consume(&connection->rbuf, HEADER_SIZE + len);
+    return true;
+}
+
+/*
+ * Runs every complete request in rbuf and flushes all their responses with
+ * one write, so a pipelined batch costs one syscall instead of one per
+ * request. Only when wbuf fills up mid-batch is it flushed early.
+ */
+static void try_requests(Connection* connection)
+{
+    while (connection->state == STATE_REQ) {
+        while (handle_one_request(connection)) {}
+        if (connection->state != STATE_REQ || connection->wbuf.size == 0) {
+            return;
+        }
+        connection->state = STATE_RES;
+        state_res(connection);
+    }
+}
+
+// Makes room in rbuf for more input. A message larger than rbuf grows it
+// by what has arrived so far, at most up to the message's end: the length
+// in the header is the peer's claim, and must not pin memory on its own.
+static bool rbuf_make_room(Connection* connection)
+{
+    Buffer* rbuf = &connection->rbuf;
+    size_t need = 1;
+    if (rbuf->size >= HEADER_SIZE) {
+        uint32_t len = 0;
+        memcpy(&len, &rbuf->data[0], HEADER_SIZE);
+        if (len > g_config.max_message_size) {
+            msg("too long");
+            connection->state = STATE_END;
+            return false;
+        }
+        if (HEADER_SIZE + len > rbuf->size) {
+            const size_t remain = HEADER_SIZE + len - rbuf->size;
+            need = remain < rbuf->size ? remain : rbuf->size;
+        }
+    }
+    if (!buf_reserve(rbuf, need)) {
+        msg("out of memory");
+        connection->state = STATE_END;
+        return false;
+    }
+    return true;
+}
+
+static inline bool try_full_buffer(Connection* connection)
+{
+    if (!rbuf_make_room(connection)) {
+        return false;
+    }
+    Buffer* rbuf = &connection->rbuf;
+    ssize_t rv = 0;
+    do {
+        rv = read(connection->fd, &rbuf->data[rbuf->size], rbuf->capacity - rbuf->size);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN) {
+        if (rbuf->size == 0) {
+            // Idle: hand the block back until the peer sends something.
+            buf_free(rbuf);
+        }
+        return false;
+    }
+    if (rv < 0) {
+        msg("read() error");
+        connection->state = STATE_END;
+        return false;
+    }
+    if (0 == rv) {
+        if (rbuf->size > 0) {
+            msg("unexpected EOF");
+        }
+        connection->state = STATE_END;
+        return false;
+    }
+
+    rbuf->size += (size_t)rv;
+    assert(rbuf->size <= rbuf->capacity);
+
+    try_requests(connection);
+    return (connection->state == STATE_REQ);
+}
+
+static inline void state_req(Connection* connection)
+{
+    while (try_full_buffer(connection));
+}
+
+/*
+ * The output stream is wbuf with the referenced values spliced in at their
+ * positions. wbuf_sent counts the wbuf bytes sent, ref_sent the bytes of the
+ * first reference; a reference is sent once wbuf_sent reaches its pos.
+ */
+static size_t connection_iov(Connection* connection, struct iovec* iov, const size_t max)
+{
+    size_t n = 0;
+    size_t pos = connection->wbuf_sent;
+    size_t ref_sent = connection->ref_sent;
+    for (Out_Ref* ref = connection->refs; n < max; ref = ref->next) {
+        const size_t end = ref != NULL ? ref->pos : connection->wbuf.size;
+        if (end > pos) {
+            iov[n].iov_base = &connection->wbuf.data[pos];
+            iov[n].iov_len = end - pos;
+            ++n;
+            pos = end;
+        }
+        if (NULL == ref || n == max) {
+            break;
+        }
+        iov[n].iov_base = (void*)&entry_value(ref->entry)[ref_sent];
+        iov[n].iov_len = ref->entry->value_len - ref_sent;
+        ++n;
+        ref_sent = 0;
+    }
+    return n;
+}
+
+// Advances the output stream by `n` sent bytes; true once it is all sent.
+static bool connection_sent(Connection* connection, size_t n)
+{
+    while (true) {
+        Out_Ref* ref = connection->refs;
+        const size_t end = ref != NULL ? ref->pos : connection->wbuf.size;
+        const size_t k = n < end - connection->wbuf_sent ? n : end - connection->wbuf_sent;
+        connection->wbuf_sent += k;
+        n -= k;
+        if (NULL == ref || connection->wbuf_sent < end) {
+            break;
+        }
+        const size_t size = ref->entry->value_len;
+        const size_t m = n < size - connection->ref_sent ? n : size - connection->ref_sent;
+        connection->ref_sent += m;
+        n -= m;
+        if (connection->ref_sent < size) {
+            break;
+        }
+        connection->refs = ref->next;
+        if (NULL == connection->refs) {
+            connection->refs_tail = NULL;
+        }
+        connection->ref_bytes -= size;
+        connection->ref_sent = 0;
+        entry_unref(ref->entry);
+        free(ref);
+    }
+    assert(n == 0);
+    if (connection->wbuf_sent < connection->wbuf.size || connection->refs != NULL) {
+        return false;
+    }
+    connection->wbuf_sent = 0;
+    buf_consume(&connection->wbuf, connection->wbuf.size);
+    return true;
+}
+
+static inline bool try_flush_buffer(Connection* connection)
+{
+    struct iovec iov[SEND_IOV_MAX];
+    const size_t n = connection_iov(connection, iov, SEND_IOV_MAX);
+    ssize_t rv = 0;
+    do {
+        rv = writev(connection->fd, iov, (int)n);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN) {
+        return false;
+    }
+    if (rv < 0){
+        msg("write() error");
+        connection->state = STATE_END;
+        return false;
+    }
+    if (connection_sent(connection, (size_t)rv)) {
+        connection->state = STATE_REQ;
+        return false;
+    }
+    return true;
+}
+
+static inline void state_res(Connection* connection)
+{
+    while (try_flush_buffer(connection));
+}
+
+// Continues after a response went out: pipelined requests may already be
+// waiting in rbuf, and the edge-triggered backend has to drain the socket.
+static inline void connection_resume(Connection* connection)
+{
+    try_requests(connection);
+    if (connection->state == STATE_REQ) {
+        state_req(connection);
+    }
+}
+
+static inline void connection_io(Connection* connection)
+{
+    if (connection->state == STATE_REQ) {
+        state_req(connection);
+    } else if (connection->state == STATE_RES) {
+        state_res(connection);
+        if (connection->state == STATE_REQ) {
+            connection_resume(connection);
+        }
+    } else if (connection->state == STATE_WAIT) {
+        // Input stays in the socket until the shard reply arrives.
+    } else {
+        assert(false);
+    }
+}
+
+static void run_poll_loop(const int fd)
+{
+    std::vector<Connection*> fd2connection;
     std::vector<struct pollfd> poll_args;
+    Timer_Wheel timers;
+    tw_init(&timers, get_monotonic_msec());
+    Slab_Release slab_release;
+    slab_release_start(&slab_release, &timers);
     while (true) {
         poll_args.clear();
         struct pollfd pfd = {fd, POLLIN, 0};
@@ -478,27 +2016,490 @@ int main()
             poll_args.push_back(pfd);
         }
 
-        const int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
+        const int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), loop_timeout(&timers));
         if (rv < 0) {
             die("poll");
         }
+        tw_advance(&timers, get_monotonic_msec());
 
         for (size_t i = 1; i < poll_args.size(); ++i) {
             if (poll_args[i].revents) {
                 Connection* connection = fd2connection[poll_args[i].fd];
                 connection_io(connection);
                 if (connection->state == STATE_END) {
-                    fd2connection[connection->fd] = NULL;
-                    (void)close(connection->fd);
-                    free(connection);
+                    connection_done(fd2connection, connection);
+                } else {
+                    connection_touch(&timers, connection);
                 }
             }
         }
 
         if (poll_args[0].revents) {
-            (void)accept_new_connection(fd2connection, fd);
+            Connection* connection = accept_new_connection(fd2connection, fd);
+            if (NULL != connection) {
+                connection_touch(&timers, connection);
+            }
+        }
+    }
+}
+
+#ifdef __linux__
+/*
+ * Connections are registered once, edge-triggered, and the interest set is
+ * only modified when a connection switches between STATE_REQ and STATE_RES.
+ * A wakeup therefore costs O(ready fds) instead of O(connections).
+ */
+static inline uint32_t epoll_interest(const uint32_t state)
+{
+    return (state == STATE_RES ? EPOLLOUT : EPOLLIN) | EPOLLET;
+}
+
+static inline void epoll_ctl_connection(const int epfd, const int op, Connection* connection)
+{
+    struct epoll_event event = {};
+    event.events = epoll_interest(connection->state);
+    event.data.fd = connection->fd;
+    if (0 != epoll_ctl(epfd, op, connection->fd, &event)) {
+        die("epoll_ctl()");
+    }
+}
+
+// Finished connections are only collected in `dead`: a later event of the
+// same epoll_wait batch may still name the fd, which must not be freed or,
+// once closed, handed out again by accept() before the batch is over.
+static inline void epoll_connection_update(const int epfd, std::vector<Connection*>& dead,
+                                           Connection* connection, const uint32_t state)
+{
+    if (connection->state == STATE_END) {
+        dead.push_back(connection);
+    } else if (epoll_interest(connection->state) != epoll_interest(state)) {
+        epoll_ctl_connection(epfd, EPOLL_CTL_MOD, connection);
+    }
+}
+
+// Serves requests forwarded by other shards and delivers replies to ours.
+static void shard_poll(const int epfd, std::vector<Connection*>& dead)
+{
+    uint64_t count = 0;
+    (void)read(g_shard->event_fd, &count, sizeof(count));
+
+    Mpsc_Node* node = NULL;
+    while ((node = mpsc_pop(&g_shard->queue)) != NULL) {
+        Shard_Msg* shard_msg = CONTAINER_OF(node, struct Shard_Msg, node);
+        if (shard_msg->src != g_shard->id) {
+            shard_execute(shard_msg);
+            shard_send(shard_msg->src, shard_msg);
+            continue;
+        }
+
+        Connection* connection = shard_msg->connection;
+        assert(connection->state == STATE_WAIT && connection->pending > 0);
+        shard_msg->next = connection->replies;
+        connection->replies = shard_msg;
+        if (--connection->pending > 0) {
+            continue;
+        }
+
+        // Responses queued ahead of this one are flushed together with it.
+        const Frame frame = respond_begin(connection);
+        shard_gather(connection, &connection->wbuf);
+        respond_end(connection, frame);
+        connection->state = STATE_REQ;
+        connection_resume(connection);
+        // The fd stayed registered for input while the request was away.
+        epoll_connection_update(epfd, dead, connection, STATE_REQ);
+    }
+}
+
+static inline void shard_notify()
+{
+    for (uint32_t i = 0; i < g_shards.nshards; ++i) {
+        if (g_shard->notify[i]) {
+            g_shard->notify[i] = false;
+            const uint64_t one = 1;
+            (void)write(g_shards.shards[i].event_fd, &one, sizeof(one));
+        }
+    }
+}
+
+static void run_epoll_loop(const int fd)
+{
+    const int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        die("epoll_create1()");
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event)) {
+        die("epoll_ctl()");
+    }
+    if (g_shard != NULL) {
+        event.data.fd = g_shard->event_fd;
+        if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, g_shard->event_fd, &event)) {
+            die("epoll_ctl()");
+        }
+    }
+
+    std::vector<Connection*> fd2connection;
+    std::vector<Connection*> dead;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    Timer_Wheel timers;
+    tw_init(&timers, get_monotonic_msec());
+    Slab_Release slab_release;
+    slab_release_start(&slab_release, &timers);
+    while (true) {
+        const int n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, loop_timeout(&timers));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            die("epoll_wait()");
+        }
+        tw_advance(&timers, get_monotonic_msec());
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == fd) {
+                Connection* connection = accept_new_connection(fd2connection, fd);
+                if (NULL != connection) {
+                    epoll_ctl_connection(epfd, EPOLL_CTL_ADD, connection);
+                    connection_touch(&timers, connection);
+                }
+                continue;
+            }
+            if (g_shard != NULL && events[i].data.fd == g_shard->event_fd) {
+                shard_poll(epfd, dead);
+                continue;
+            }
+            Connection* connection = fd2connection[events[i].data.fd];
+            if (NULL == connection || connection->state == STATE_END) {
+                continue;
+            }
+            const uint32_t state = connection->state;
+            connection_io(connection);
+            if (connection->state != STATE_END) {
+                connection_touch(&timers, connection);
+            }
+            epoll_connection_update(epfd, dead, connection, state);
+        }
+
+        // close() also drops the fd from the epoll interest list
+        for (size_t i = 0; i < dead.size(); ++i) {
+            connection_done(fd2connection, dead[i]);
+        }
+        dead.clear();
+
+        if (g_shard != NULL) {
+            shard_notify();
+        }
+    }
+}
+
+/*
+ * Completion-based backend. Each connection has exactly one recv or send in
+ * flight, decided by its state, and every pass through the loop submits all
+ * queued operations and reaps all completions with a single io_uring_enter().
+ * The request/response state machine is shared with the readiness backends.
+ */
+static inline void uring_queue_accept(Uring* ring, const int fd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->user_data = 0;
+}
+
+static inline void uring_queue_recv(Uring* ring, Connection* connection)
+{
+    Buffer* rbuf = &connection->rbuf;
+    assert(rbuf->size < rbuf->capacity);
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&rbuf->data[rbuf->size];
+    sqe->len = (uint32_t)(rbuf->capacity - rbuf->size);
+    sqe->user_data = (uint64_t)(uintptr_t)connection;
+}
+
+// Sends the next contiguous piece of the output stream; the iovec array
+// would have to outlive the call, a pointer and length need not.
+static inline void uring_queue_send(Uring* ring, Connection* connection)
+{
+    struct iovec iov;
+    const size_t n = connection_iov(connection, &iov, 1);
+    assert(n == 1);
+    (void)n;
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection->fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov.iov_base;
+    sqe->len = (uint32_t)iov.iov_len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)connection;
+}
+
+// Queues the next operation for a connection in STATE_REQ: one send for
+// all the responses of the buffered requests, or a recv for more input.
+static inline void uring_connection_next(Uring* ring, Connection* connection)
+{
+    while (handle_one_request(connection)) {}
+    if (connection->state != STATE_REQ) {
+        return;
+    }
+    if (connection->wbuf.size > 0) {
+        connection->state = STATE_RES;
+        uring_queue_send(ring, connection);
+    } else if (rbuf_make_room(connection)) {
+        uring_queue_recv(ring, connection);
+    }
+}
+
+static inline void uring_connection_io(Uring* ring, Connection* connection, const int32_t res)
+{
+    if (connection->state == STATE_REQ) {
+        if (res <= 0) {
+            if (res < 0) {
+                msg("recv() error");
+            } else if (connection->rbuf.size > 0) {
+                msg("unexpected EOF");
+            }
+            connection->state = STATE_END;
+            return;
+        }
+        connection->rbuf.size += (size_t)res;
+        assert(connection->rbuf.size <= connection->rbuf.capacity);
+        uring_connection_next(ring, connection);
+    } else if (connection->state == STATE_RES) {
+        if (res < 0) {
+            msg("send() error");
+            connection->state = STATE_END;
+            return;
+        }
+        if (!connection_sent(connection, (size_t)res)) {
+            uring_queue_send(ring, connection);
+            return;
+        }
+        connection->state = STATE_REQ;
+        uring_connection_next(ring, connection);
+    } else {
+        assert(false);
+    }
+}
+
+static void run_uring_loop(const int fd)
+{
+    Uring ring;
+    if (0 != uring_init(&ring, URING_ENTRIES)) {
+        die("io_uring_setup()");
+    }
+
+    std::vector<Connection*> fd2connection;
+    Timer_Wheel timers;
+    tw_init(&timers, get_monotonic_msec());
+    Slab_Release slab_release;
+    slab_release_start(&slab_release, &timers);
+    uring_queue_accept(&ring, fd);
+    while (true) {
+        if (uring_submit_and_wait(&ring, 1, tw_timeout(&timers)) < 0) {
+            die("io_uring_enter()");
+        }
+        tw_advance(&timers, get_monotonic_msec());
+
+        struct io_uring_cqe* cqe = NULL;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            Connection* connection = (Connection*)(uintptr_t)cqe->user_data;
+            const int32_t res = cqe->res;
+            uring_cqe_seen(&ring);
+
+            if (NULL == connection) {
+                if (res >= 0) {
+                    connection = connection_new(fd2connection, res);
+                    if (NULL != connection) {
+                        uring_connection_next(&ring, connection);
+                        connection_touch(&timers, connection);
+                    }
+                } else {
+                    msg("accept() error");
+                }
+                uring_queue_accept(&ring, fd);
+                continue;
+            }
+
+            uring_connection_io(&ring, connection, res);
+            if (connection->state == STATE_END) {
+                connection_done(fd2connection, connection);
+            } else {
+                connection_touch(&timers, connection);
+            }
+        }
+    }
+}
+#endif // __linux__
+
+static int listen_on(const uint16_t port, const bool reuseport)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+
+    const int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#ifdef SO_REUSEPORT
+    if (reuseport && 0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+        die("setsockopt(SO_REUSEPORT)");
+    }
+#endif
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(port);
+    addr.sin_addr.s_addr = ntohl(0);
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv) {
+        die("bind()");
+    }
+
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen");
+    }
+    return fd;
+}
+
+#ifdef __linux__
+static void* shard_main(void* arg)
+{
+    g_shard = (Shard*)arg;
+    const int fd = listen_on(1234, true);
+    fd_set_nb(fd);
+    run_epoll_loop(fd);
+    return NULL;
+}
+
+static void run_shards(const uint32_t nshards)
+{
+    g_shards.nshards = nshards;
+    g_shards.shards = new Shard[nshards];
+    for (uint32_t i = 0; i < nshards; ++i) {
+        Shard* shard = &g_shards.shards[i];
+        mpsc_init(&shard->queue);
+        shard->id = i;
+        shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->event_fd < 0) {
+            die("eventfd()");
+        }
+        memset(shard->notify, 0, sizeof(shard->notify));
+    }
+    for (uint32_t i = 1; i < nshards; ++i) {
+        if (0 != pthread_create(&g_shards.shards[i].thread, NULL, &shard_main, &g_shards.shards[i])) {
+            die("pthread_create()");
+        }
+    }
+    (void)shard_main(&g_shards.shards[0]);
+}
+#endif // __linux__
+
+int main(int argc, char* argv[])
+{
+    bool use_poll = false;
+#ifdef __linux__
+    bool use_uring = false;
+    uint32_t nshards = 1;
+#endif
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--poll")) {
+            use_poll = true;
+#ifdef __linux__
+        } else if (0 == strcmp(argv[i], "--io-uring")) {
+            use_uring = true;
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nshards = (uint32_t)atoi(argv[++i]);
+            if (nshards < 1 || nshards > MAX_SHARDS) {
+                fprintf(stderr, "--threads must be within [1, %d]\n", MAX_SHARDS);
+                return 1;
+            }
+#endif
+        } else if (0 == strcmp(argv[i], "--idle-timeout-ms") && i + 1 < argc) {
+            // 0 keeps idle connections forever.
+            g_config.idle_timeout_ms = (uint64_t)atoll(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--hash-engine") && i + 1 < argc) {
+            ++i;
+            if (0 == strcmp(argv[i], "chain")) {
+                g_config.hash_engine = ENGINE_CHAIN;
+            } else if (0 == strcmp(argv[i], "swiss")) {
+                g_config.hash_engine = ENGINE_SWISS;
+            } else {
+                fprintf(stderr, "--hash-engine must be chain or swiss\n");
+                return 1;
+            }
+        } else if (0 == strcmp(argv[i], "--allocator") && i + 1 < argc) {
+            ++i;
+            if (0 == strcmp(argv[i], "slab")) {
+                g_config.allocator = ALLOC_SLAB;
+            } else if (0 == strcmp(argv[i], "malloc")) {
+                g_config.allocator = ALLOC_MALLOC;
+            } else {
+                fprintf(stderr, "--allocator must be slab or malloc\n");
+                return 1;
+            }
+        } else if (0 == strcmp(argv[i], "--zset-engine") && i + 1 < argc) {
+            ++i;
+            if (0 == strcmp(argv[i], "avl")) {
+                g_config.zset_engine = ZSET_AVL;
+            } else if (0 == strcmp(argv[i], "btree")) {
+                g_config.zset_engine = ZSET_BTREE;
+            } else {
+                fprintf(stderr, "--zset-engine must be avl or btree\n");
+                return 1;
+            }
+        } else if (0 == strcmp(argv[i], "--max-message-size") && i + 1 < argc) {
+            const long long size = atoll(argv[++i]);
+            if (size < MIN_MAX_MESSAGE_SIZE || size > UINT32_MAX - HEADER_SIZE) {
+                fprintf(stderr, "--max-message-size must be within [%d, %u]\n",
+                        MIN_MAX_MESSAGE_SIZE, UINT32_MAX - HEADER_SIZE);
+                return 1;
+            }
+            g_config.max_message_size = (size_t)size;
+        } else {
+            fprintf(stderr, "usage: %s [--poll | --io-uring | --threads N] [--hash-engine chain|swiss] [--allocator slab|malloc] [--zset-engine avl|btree] [--max-message-size BYTES] [--idle-timeout-ms MS]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Writes to peers that went away must fail with EPIPE, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    hash_init();
+
+#ifdef __linux__
+    if (nshards > 1) {
+        if (use_poll || use_uring) {
+            fprintf(stderr, "--threads requires the epoll backend\n");
+            return 1;
         }
+        run_shards(nshards);
+    }
+#endif
+
+    const int fd = listen_on(1234, false);
+
+#ifdef __linux__
+    if (use_uring) {
+        // The listener and accepted sockets stay blocking; io_uring waits
+        // for readiness itself instead of bouncing back -EAGAIN.
+        run_uring_loop(fd);
+    }
+#endif
+
+    fd_set_nb(fd);
+
+#ifdef __linux__
+    if (!use_poll) {
+        run_epoll_loop(fd);
     }
+#endif
+    run_poll_loop(fd);
 
     return 0;
 }
@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define SLAB_SIZE       (64 << 10)
+// The header takes the first line; objects start after it.
+#define SLAB_HEADER     64
+// Empty slabs each class keeps for reuse before unmapping more.
+#define KEEP_EMPTY      1
+
+static const uint32_t g_class_size[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+};
+#define NUM_CLASSES     (sizeof(g_class_size) / sizeof(g_class_size[0]))
+#define MAX_OBJECT_SIZE 512
+
+// Lives at the start of its SLAB_SIZE-aligned slab, so masking an object's
+// address finds it.
+struct Slab
+{
+    Slab* prev;
+    Slab* next;
+    void* free_list;
+    uint32_t cls;
+    uint32_t used;
+    // Slots from `fresh` on were never handed out since the slab was empty.
+    uint32_t fresh;
+    uint32_t capacity;
+};
+static_assert(sizeof(Slab) <= SLAB_HEADER, "slab header too large");
+
+// Circular and doubly linked, so a slab moves between lists in O(1).
+struct Slab_List
+{
+    Slab* head;
+    size_t count;
+};
+
+// Allocation takes the first partial slab, and slabs that stop being full
+// go to the back, so new objects pack into the fullest slabs while sparse
+// ones get a chance to drain and be released.
+struct Slab_Class
+{
+    Slab_List partial;
+    Slab_List full;
+    Slab_List empty;
+};
+
+static thread_local Slab_Class g_classes[NUM_CLASSES];
+static size_t g_bytes_mapped;
+
+static inline size_t size_class(const size_t size)
+{
+    size_t cls = 0;
+    while (g_class_size[cls] < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+static inline void list_remove(Slab_List* list, Slab* slab)
+{
+    if (slab->next == slab) {
+        list->head = NULL;
+    } else {
+        slab->prev->next = slab->next;
+        slab->next->prev = slab->prev;
+        if (list->head == slab) {
+            list->head = slab->next;
+        }
+    }
+    --list->count;
+}
+
+static inline void list_push_back(Slab_List* list, Slab* slab)
+{
+    Slab* head = list->head;
+    if (NULL == head) {
+        slab->prev = slab->next = slab;
+        list->head = slab;
+    } else {
+        slab->prev = head->prev;
+        slab->next = head;
+        head->prev->next = slab;
+        head->prev = slab;
+    }
+    ++list->count;
+}
+
+static inline void list_push_front(Slab_List* list, Slab* slab)
+{
+    list_push_back(list, slab);
+    list->head = slab;
+}
+
+static Slab* slab_map(const uint32_t cls)
+{
+    // Map twice the size and trim, for the alignment.
+    uint8_t* p = (uint8_t*)mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == p) {
+        return NULL;
+    }
+    uint8_t* start = (uint8_t*)(((uintptr_t)p + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (start > p) {
+        munmap(p, start - p);
+    }
+    munmap(start + SLAB_SIZE, p + SLAB_SIZE - start);
+    __atomic_fetch_add(&g_bytes_mapped, (size_t)SLAB_SIZE, __ATOMIC_RELAXED);
+
+    Slab* slab = (Slab*)start;
+    slab->free_list = NULL;
+    slab->cls = cls;
+    slab->used = 0;
+    slab->fresh = 0;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / g_class_size[cls];
+    return slab;
+}
+
+static void slab_unmap(Slab* slab)
+{
+    munmap(slab, SLAB_SIZE);
+    __atomic_fetch_sub(&g_bytes_mapped, (size_t)SLAB_SIZE, __ATOMIC_RELAXED);
+}
+
+void* slab_alloc(const size_t size)
+{
+    if (size > MAX_OBJECT_SIZE) {
+        return malloc(size);
+    }
+    const size_t cls = size_class(size);
+    Slab_Class* c = &g_classes[cls];
+    Slab* slab = c->partial.head;
+    if (NULL == slab) {
+        slab = c->empty.head;
+        if (slab != NULL) {
+            list_remove(&c->empty, slab);
+        } else if (NULL == (slab = slab_map(cls))) {
+            return NULL;
+        }
+        list_push_front(&c->partial, slab);
+    }
+
+    void* p = slab->free_list;
+    if (p != NULL) {
+        slab->free_list = *(void**)p;
+    } else {
+        p = (uint8_t*)slab + SLAB_HEADER + (size_t)slab->fresh++ * g_class_size[cls];
+    }
+    if (++slab->used == slab->capacity) {
+        list_remove(&c->partial, slab);
+        list_push_front(&c->full, slab);
+    }
+    return p;
+}
+
+void slab_free(void* p, const size_t size)
+{
+    if (size > MAX_OBJECT_SIZE) {
+        return free(p);
+    }
+    Slab* slab = (Slab*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+    Slab_Class* c = &g_classes[slab->cls];
+    assert(slab->cls == size_class(size) && slab->used > 0);
+    *(void**)p = slab->free_list;
+    slab->free_list = p;
+    if (slab->used-- == slab->capacity) {
+        list_remove(&c->full, slab);
+        list_push_back(&c->partial, slab);
+    }
+    if (slab->used > 0) {
+        return;
+    }
+    list_remove(&c->partial, slab);
+    if (c->empty.count < KEEP_EMPTY) {
+        // Start over from the first slot, leaving untouched pages untouched.
+        slab->free_list = NULL;
+        slab->fresh = 0;
+        list_push_front(&c->empty, slab);
+    } else {
+        slab_unmap(slab);
+    }
+}
+
+size_t slab_release_empty()
+{
+    size_t n = 0;
+    for (size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+        Slab_List* empty = &g_classes[cls].empty;
+        while (empty->head != NULL) {
+            Slab* slab = empty->head;
+            list_remove(empty, slab);
+            slab_unmap(slab);
+            n += SLAB_SIZE;
+        }
+    }
+    return n;
+}
+
+size_t slab_num_classes()
+{
+    return NUM_CLASSES;
+}
+
+static void list_stats(const Slab_List* list, Slab_Stats* stats)
+{
+    Slab* slab = list->head;
+    for (size_t i = 0; i < list->count; ++i, slab = slab->next) {
+        stats->used += slab->used;
+        stats->capacity += slab->capacity;
+        if (slab->used > 0) {
+            const size_t quarter = (4 * (size_t)slab->used - 1) / slab->capacity;
+            ++stats->fill[quarter];
+        }
+    }
+}
+
+void slab_stats(const size_t cls, Slab_Stats* stats)
+{
+    assert(cls < NUM_CLASSES);
+    const Slab_Class* c = &g_classes[cls];
+    *stats = Slab_Stats{};
+    stats->object_size = g_class_size[cls];
+    stats->slabs = c->partial.count + c->full.count + c->empty.count;
+    stats->empty = c->empty.count;
+    list_stats(&c->partial, stats);
+    list_stats(&c->full, stats);
+    list_stats(&c->empty, stats);
+}
+
+size_t slab_bytes_mapped()
+{
+    return __atomic_load_n(&g_bytes_mapped, __ATOMIC_RELAXED);
+}
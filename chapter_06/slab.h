@@ -0,0 +1,42 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Allocator for the small structs the server keeps many of: entries and
+ * connections. Each size class carves its objects from 64 KiB slabs mapped
+ * straight from the OS, so the free slots of deleted keys are reused by
+ * new keys of that class, and a slab whose objects are all gone can be
+ * unmapped instead of lingering in the malloc heap.
+ * Like the buffer pool the slabs are per thread: an object must be freed
+ * by the thread that allocated it.
+ */
+
+// Objects above the largest class come from malloc; NULL if out of memory.
+void* slab_alloc(size_t size);
+// `size` must be the one given to slab_alloc.
+void slab_free(void* p, size_t size);
+// Unmaps the calling thread's empty slabs kept for reuse; returns the bytes.
+size_t slab_release_empty();
+
+struct Slab_Stats
+{
+    size_t object_size;
+    // Slabs mapped, the empty ones included.
+    size_t slabs;
+    size_t empty;
+    size_t used;
+    size_t capacity;
+    // Non-empty slabs by occupancy: up to 1/4, 1/2, 3/4, and above.
+    size_t fill[4];
+};
+
+size_t slab_num_classes();
+// Walks the calling thread's slabs of class `cls`.
+void slab_stats(size_t cls, Slab_Stats* stats);
+// Process-wide total of mapped slab bytes.
+size_t slab_bytes_mapped();
+
+#endif // __SLAB_H__
@@ -0,0 +1,359 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "swisstable.h"
+
+// Slots scanned per operation while a resize is in progress.
+#define RESIZING_WORK 128
+// Resize once taken plus deleted slots reach 7/8 of the capacity.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+// Shrink to half below 1/8, which leaves the load at 1/4 after halving.
+#define MIN_LOAD_DEN 8
+#define MIN_CAPACITY SW_GROUP_SIZE
+
+// Taken slots hold the low 7 bits of the hash, so the high bit marks the
+// two free states.
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+#define NO_SLOT      ((size_t)-1)
+
+static inline uint8_t h_tag(const uint64_t hcode)
+{
+    return (uint8_t)(hcode & 0x7F);
+}
+
+static inline size_t h_group(const Swiss_Table* stab, const uint64_t hcode)
+{
+    return (size_t)(hcode >> 7) & (stab->mask / SW_GROUP_SIZE);
+}
+
+// Bit i is set if ctrl[i] == tag.
+static inline uint32_t group_match(const uint8_t* ctrl, const uint8_t tag)
+{
+#ifdef __SSE2__
+    const __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < SW_GROUP_SIZE; ++i) {
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i is set if ctrl[i] is EMPTY or DELETED.
+static inline uint32_t group_match_free(const uint8_t* ctrl)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < SW_GROUP_SIZE; ++i) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline void s_init(Swiss_Table* stab, const size_t n)
+{
+    // Must be power of 2, and whole groups
+    assert(n >= SW_GROUP_SIZE && ((n - 1) & n) == 0);
+    stab->ctrl = (uint8_t*)aligned_alloc(SW_GROUP_SIZE, n);
+    stab->slots = (Hash_Node**)calloc(sizeof(Hash_Node *), n);
+    memset(stab->ctrl, CTRL_EMPTY, n);
+    stab->mask = n - 1;
+    stab->size = 0;
+    stab->deleted = 0;
+}
+
+static inline void s_free(Swiss_Table* stab)
+{
+    free(stab->ctrl);
+    free(stab->slots);
+    stab->ctrl = NULL;
+    stab->slots = NULL;
+    stab->mask = stab->size = stab->deleted = 0;
+}
+
+/*
+ * Probes whole groups in triangular steps (g, g+1, g+3, g+6, ...), which
+ * visits every group of a power-of-2 table. A group with an EMPTY slot ends
+ * the probe: no insert ever went past it.
+ */
+static inline size_t s_lookup(Swiss_Table* stab, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+{
+    if (NULL == stab->ctrl) {
+        return NO_SLOT;
+    }
+
+    const uint8_t tag = h_tag(key->hcode);
+    const size_t gmask = stab->mask / SW_GROUP_SIZE;
+    size_t group = h_group(stab, key->hcode);
+    for (size_t step = 1; step <= gmask + 1; ++step) {
+        const uint8_t* ctrl = &stab->ctrl[group * SW_GROUP_SIZE];
+        for (uint32_t match = group_match(ctrl, tag); match != 0; match &= match - 1) {
+            const size_t pos = group * SW_GROUP_SIZE + __builtin_ctz(match);
+            Hash_Node* current = stab->slots[pos];
+            if (current->hcode == key->hcode && eq(current, key)) {
+                return pos;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & gmask;
+    }
+    return NO_SLOT;
+}
+
+static inline void s_insert(Swiss_Table* stab, Hash_Node* node)
+{
+    const size_t gmask = stab->mask / SW_GROUP_SIZE;
+    size_t group = h_group(stab, node->hcode);
+    for (size_t step = 1; ; ++step) {
+        const uint32_t match = group_match_free(&stab->ctrl[group * SW_GROUP_SIZE]);
+        if (match != 0) {
+            const size_t pos = group * SW_GROUP_SIZE + __builtin_ctz(match);
+            if (stab->ctrl[pos] == CTRL_DELETED) {
+                --stab->deleted;
+            }
+            stab->ctrl[pos] = h_tag(node->hcode);
+            stab->slots[pos] = node;
+            ++stab->size;
+            return;
+        }
+        // The load factor guarantees a free slot somewhere.
+        assert(step <= gmask);
+        group = (group + step) & gmask;
+    }
+}
+
+static inline Hash_Node* s_detach(Swiss_Table* stab, const size_t pos)
+{
+    Hash_Node* node = stab->slots[pos];
+    // A group that still has an EMPTY slot was never full, so no probe
+    // passed through it and the slot can be EMPTY again.
+    const uint8_t* ctrl = &stab->ctrl[pos & ~(size_t)(SW_GROUP_SIZE - 1)];
+    if (group_match(ctrl, CTRL_EMPTY) != 0) {
+        stab->ctrl[pos] = CTRL_EMPTY;
+    } else {
+        stab->ctrl[pos] = CTRL_DELETED;
+        ++stab->deleted;
+    }
+    stab->slots[pos] = NULL;
+    --stab->size;
+    return node;
+}
+
+static inline bool s_overloaded(const Swiss_Table* stab)
+{
+    return (stab->size + stab->deleted) * MAX_LOAD_DEN >= (stab->mask + 1) * MAX_LOAD_NUM;
+}
+
+static inline void sm_resizing_helper(Swiss_Map* smap)
+{
+    if (NULL == smap->table2.ctrl) {
+        return;
+    }
+    const size_t capacity = smap->table2.mask + 1;
+    size_t nwork = 0;
+    while (nwork < RESIZING_WORK && smap->table2.size > 0 && smap->resizing_pos < capacity) {
+        const size_t pos = smap->resizing_pos++;
+        if (smap->table2.ctrl[pos] < CTRL_EMPTY) {
+            s_insert(&smap->table1, s_detach(&smap->table2, pos));
+        }
+        ++nwork;
+    }
+    if (smap->table2.size == 0) {
+        s_free(&smap->table2);
+    }
+}
+
+static inline void sm_start_resizing(Swiss_Map* smap, const size_t n)
+{
+    assert(smap->table2.ctrl == NULL);
+    smap->table2 = smap->table1;
+    s_init(&smap->table1, n);
+    smap->resizing_pos = 0;
+}
+
+// Main Interface
+
+Hash_Node* sm_lookup(Swiss_Map* smap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+{
+    sm_resizing_helper(smap);
+    size_t pos = s_lookup(&smap->table1, key, eq);
+    if (pos != NO_SLOT) {
+        return smap->table1.slots[pos];
+    }
+    pos = s_lookup(&smap->table2, key, eq);
+    return pos != NO_SLOT ? smap->table2.slots[pos] : NULL;
+}
+
+void sm_insert(Swiss_Map* smap, Hash_Node* node)
+{
+    if (NULL == smap->table1.ctrl) {
+        s_init(&smap->table1, MIN_CAPACITY);
+    }
+    if (s_overloaded(&smap->table1)) {
+        // Finish the previous resize first; in practice it is long done.
+        while (smap->table2.ctrl != NULL) {
+            sm_resizing_helper(smap);
+        }
+        // Tables made mostly of DELETED slots are rebuilt at the same size.
+        const size_t capacity = smap->table1.mask + 1;
+        sm_start_resizing(smap, smap->table1.size * 2 < capacity ? capacity : capacity * 2);
+    }
+    s_insert(&smap->table1, node);
+    sm_resizing_helper(smap);
+}
+
+Hash_Node* sm_pop(Swiss_Map* smap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *))
+{
+    sm_resizing_helper(smap);
+    size_t pos = s_lookup(&smap->table1, key, eq);
+    Hash_Node* node = NULL;
+    if (pos != NO_SLOT) {
+        node = s_detach(&smap->table1, pos);
+    } else if ((pos = s_lookup(&smap->table2, key, eq)) != NO_SLOT) {
+        node = s_detach(&smap->table2, pos);
+    }
+    const size_t capacity = smap->table1.mask + 1;
+    if (node != NULL && NULL == smap->table2.ctrl && capacity > MIN_CAPACITY
+            && smap->table1.size * MIN_LOAD_DEN < capacity) {
+        sm_start_resizing(smap, capacity / 2);
+    }
+    return node;
+}
+
+size_t sm_size(Swiss_Map* smap)
+{
+    return smap->table1.size + smap->table2.size;
+}
+
+static inline void s_scan(Swiss_Table* stab, void (*f)(Hash_Node*, void*), void* arg)
+{
+    if (stab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i < stab->mask + 1; ++i) {
+        if (stab->ctrl[i] < CTRL_EMPTY) {
+            f(stab->slots[i], arg);
+        }
+    }
+}
+
+void sm_foreach(Swiss_Map* smap, void (*f)(Hash_Node*, void*), void* arg)
+{
+    s_scan(&smap->table1, f, arg);
+    s_scan(&smap->table2, f, arg);
+}
+
+// Visits the nodes whose home is `home`: they sit along its probe sequence,
+// which ends at the first group with an EMPTY slot.
+static inline void s_scan_group(Swiss_Table* stab, const size_t home, void (*f)(Hash_Node*, void*), void* arg)
+{
+    const size_t gmask = stab->mask / SW_GROUP_SIZE;
+    size_t group = home;
+    for (size_t step = 1; step <= gmask + 1; ++step) {
+        const uint8_t* ctrl = &stab->ctrl[group * SW_GROUP_SIZE];
+        for (size_t i = 0; i < SW_GROUP_SIZE; ++i) {
+            Hash_Node* node = stab->slots[group * SW_GROUP_SIZE + i];
+            if (ctrl[i] < CTRL_EMPTY && h_group(stab, node->hcode) == home) {
+                f(node, arg);
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & gmask;
+    }
+}
+
+// Home groups come from the low bits of hcode >> 7, just like chained
+// buckets come from the low bits of hcode, so hm_scan's walk carries over.
+uint64_t sm_scan(Swiss_Map* smap, uint64_t cursor, void (*f)(Hash_Node*, void*), void* arg)
+{
+    Swiss_Table* small = &smap->table1;
+    Swiss_Table* large = &smap->table2;
+    if (NULL == large->ctrl) {
+        if (NULL == small->ctrl) {
+            return 0;
+        }
+        const size_t gmask = small->mask / SW_GROUP_SIZE;
+        s_scan_group(small, cursor & gmask, f, arg);
+        return scan_cursor_next(cursor, gmask);
+    }
+    if (small->mask > large->mask) {
+        Swiss_Table* tmp = small;
+        small = large;
+        large = tmp;
+    }
+    const size_t small_gmask = small->mask / SW_GROUP_SIZE;
+    const size_t large_gmask = large->mask / SW_GROUP_SIZE;
+    s_scan_group(small, cursor & small_gmask, f, arg);
+    do {
+        s_scan_group(large, cursor & large_gmask, f, arg);
+        cursor = scan_cursor_next(cursor, large_gmask);
+    } while (cursor & (small_gmask ^ large_gmask));
+    return cursor;
+}
+
+static inline void s_prefetch_bucket(const Swiss_Table* stab, const uint64_t hcode)
+{
+    if (stab->ctrl != NULL) {
+        const size_t pos = h_group(stab, hcode) * SW_GROUP_SIZE;
+        __builtin_prefetch(&stab->ctrl[pos]);
+        __builtin_prefetch(&stab->slots[pos]);
+        __builtin_prefetch(&stab->slots[pos + SW_GROUP_SIZE / 2]);
+    }
+}
+
+static inline void s_prefetch_node(const Swiss_Table* stab, const uint64_t hcode)
+{
+    if (stab->ctrl != NULL) {
+        const size_t pos = h_group(stab, hcode) * SW_GROUP_SIZE;
+        const uint32_t match = group_match(&stab->ctrl[pos], h_tag(hcode));
+        if (match != 0) {
+            __builtin_prefetch(stab->slots[pos + __builtin_ctz(match)]);
+        }
+    }
+}
+
+void sm_prefetch_bucket(Swiss_Map* smap, const uint64_t hcode)
+{
+    s_prefetch_bucket(&smap->table1, hcode);
+    s_prefetch_bucket(&smap->table2, hcode);
+}
+
+void sm_prefetch_node(Swiss_Map* smap, const uint64_t hcode)
+{
+    s_prefetch_node(&smap->table1, hcode);
+    s_prefetch_node(&smap->table2, hcode);
+}
+
+size_t sm_bucket_bytes(Swiss_Map* smap)
+{
+    size_t n = 0;
+    if (smap->table1.ctrl != NULL) {
+        n += smap->table1.mask + 1;
+    }
+    if (smap->table2.ctrl != NULL) {
+        n += smap->table2.mask + 1;
+    }
+    return n * (1 + sizeof(Hash_Node *));
+}
+
+void sm_destroy(Swiss_Map* smap)
+{
+    s_free(&smap->table1);
+    s_free(&smap->table2);
+    smap->resizing_pos = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __SWISS_TABLE_H__
+#define __SWISS_TABLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+#define SW_GROUP_SIZE 16
+
+/*
+ * Open-addressing table of Hash_Node pointers (Swiss table). A dense array
+ * of control bytes holds a 7-bit tag of each slot's hash, or EMPTY/DELETED;
+ * a probe compares 16 tags at once with SSE2 and touches a node only when
+ * its tag matches. Probing goes group by group, so misses usually end at
+ * the first group with an empty slot instead of walking a chain.
+ */
+struct Swiss_Table
+{
+    uint8_t* ctrl;
+    Hash_Node** slots;
+    size_t mask;
+    size_t size;
+    // Slots that are neither EMPTY nor taken; they still lengthen probes.
+    size_t deleted;
+};
+
+// Resizes incrementally like Hash_Map, growing or shrinking: table2 is
+// moved into table1 a few slots at a time by every operation.
+struct Swiss_Map
+{
+    Swiss_Table table1;
+    Swiss_Table table2;
+    size_t resizing_pos;
+};
+
+// Same contract as the hm_ functions; the nodes' `next` field is unused.
+Hash_Node* sm_lookup(Swiss_Map* smap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *));
+void sm_insert(Swiss_Map* smap, Hash_Node* node);
+Hash_Node* sm_pop(Swiss_Map* smap, Hash_Node* key, bool (*eq)(Hash_Node *, Hash_Node *));
+size_t sm_size(Swiss_Map* smap);
+// Like hm_prefetch_*: the home group's control bytes and slots, then the
+// node of the first slot whose tag matches.
+void sm_prefetch_bucket(Swiss_Map* smap, uint64_t hcode);
+void sm_prefetch_node(Swiss_Map* smap, uint64_t hcode);
+// Bytes of the control and slot arrays, the old ones included while resizing.
+size_t sm_bucket_bytes(Swiss_Map* smap);
+void sm_foreach(Swiss_Map* smap, void (*f)(Hash_Node*, void*), void* arg);
+// Cursor scan with the guarantees of hm_scan; a cursor names the nodes
+// whose probe starts at one group rather than a bucket.
+uint64_t sm_scan(Swiss_Map* smap, uint64_t cursor, void (*f)(Hash_Node*, void*), void* arg);
+void sm_destroy(Swiss_Map* smap);
+
+#endif // __SWISS_TABLE_H__
@@ -0,0 +1,177 @@
+#include <assert.h>
+
+#include "timer.h"
+
+#define TW_SLOT_MASK    (TW_SLOTS - 1)
+#define TW_MAX_DELTA    (((uint64_t)1 << (TW_LEVELS * TW_SLOT_BITS)) - 1)
+
+static inline void list_init(Timer* head)
+{
+    head->prev = head->next = head;
+}
+
+static inline bool list_empty(Timer* head)
+{
+    return head->next == head;
+}
+
+static inline void list_insert_before(Timer* target, Timer* timer)
+{
+    Timer* prev = target->prev;
+    prev->next = timer;
+    timer->prev = prev;
+    timer->next = target;
+    target->prev = timer;
+}
+
+static inline void list_detach(Timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+static inline uint64_t rotr(const uint64_t bits, const unsigned n)
+{
+    return n == 0 ? bits : (bits >> n) | (bits << (64 - n));
+}
+
+void timer_init(Timer* timer, void (*expire)(Timer* timer))
+{
+    timer->prev = timer->next = NULL;
+    timer->expires = 0;
+    timer->expire = expire;
+}
+
+bool timer_active(Timer* timer)
+{
+    return timer->next != NULL;
+}
+
+void tw_init(Timer_Wheel* tw, const uint64_t now)
+{
+    tw->now = now;
+    for (size_t level = 0; level < TW_LEVELS; ++level) {
+        tw->bitmap[level] = 0;
+        for (size_t slot = 0; slot < TW_SLOTS; ++slot) {
+            list_init(&tw->slots[level][slot]);
+        }
+    }
+}
+
+// Files the timer by how far away it is; an overdue timer lands in the
+// slot of the current tick.
+static inline void tw_place(Timer_Wheel* tw, Timer* timer)
+{
+    const uint64_t expires = timer->expires > tw->now ? timer->expires : tw->now;
+    const uint64_t delta = expires - tw->now;
+    size_t level = 0;
+    while (level + 1 < TW_LEVELS && delta >= ((uint64_t)1 << ((level + 1) * TW_SLOT_BITS))) {
+        ++level;
+    }
+    const size_t slot = (expires >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+    list_insert_before(&tw->slots[level][slot], timer);
+    tw->bitmap[level] |= (uint64_t)1 << slot;
+}
+
+void tw_add(Timer_Wheel* tw, Timer* timer, uint64_t expires)
+{
+    if (timer_active(timer)) {
+        list_detach(timer);
+    }
+    // The current tick has already fired.
+    if (expires <= tw->now) {
+        expires = tw->now + 1;
+    }
+    if (expires - tw->now > TW_MAX_DELTA) {
+        expires = tw->now + TW_MAX_DELTA;
+    }
+    timer->expires = expires;
+    tw_place(tw, timer);
+}
+
+void tw_del(Timer* timer)
+{
+    // Bitmap bits of slots emptied here are cleared lazily.
+    if (timer_active(timer)) {
+        list_detach(timer);
+    }
+}
+
+int64_t tw_timeout(Timer_Wheel* tw)
+{
+    int64_t timeout = -1;
+    for (size_t level = 0; level < TW_LEVELS; ++level) {
+        const unsigned shift = level * TW_SLOT_BITS;
+        const uint64_t current = tw->now >> shift;
+        while (tw->bitmap[level] != 0) {
+            // Slot `s` of this level is next due on the first tick after
+            // `now` whose level index equals `s`.
+            const unsigned first = (current + 1) & TW_SLOT_MASK;
+            const uint64_t ahead = (uint64_t)__builtin_ctzll(rotr(tw->bitmap[level], first)) + 1;
+            const size_t slot = (current + ahead) & TW_SLOT_MASK;
+            if (list_empty(&tw->slots[level][slot])) {
+                tw->bitmap[level] &= ~((uint64_t)1 << slot);
+                continue;
+            }
+            const int64_t delta = (int64_t)(((current + ahead) << shift) - tw->now);
+            if (timeout < 0 || delta < timeout) {
+                timeout = delta;
+            }
+            break;
+        }
+    }
+    return timeout;
+}
+
+// Runs everything due at the current tick: timers of higher levels whose
+// slot comes up are refiled first, then the level 0 slot fires.
+static void tw_tick(Timer_Wheel* tw)
+{
+    size_t levels = 1;
+    while (levels < TW_LEVELS && (tw->now & (((uint64_t)1 << (levels * TW_SLOT_BITS)) - 1)) == 0) {
+        ++levels;
+    }
+    for (size_t level = levels - 1; level >= 1; --level) {
+        const size_t slot = (tw->now >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+        Timer* head = &tw->slots[level][slot];
+        tw->bitmap[level] &= ~((uint64_t)1 << slot);
+        while (!list_empty(head)) {
+            Timer* timer = head->next;
+            list_detach(timer);
+            tw_place(tw, timer);
+        }
+    }
+
+    const size_t slot = tw->now & TW_SLOT_MASK;
+    Timer expired;
+    list_init(&expired);
+    Timer* head = &tw->slots[0][slot];
+    if (!list_empty(head)) {
+        // Move the slot aside so callbacks may re-arm or delete timers.
+        expired.next = head->next;
+        expired.prev = head->prev;
+        expired.next->prev = expired.prev->next = &expired;
+        list_init(head);
+    }
+    tw->bitmap[0] &= ~((uint64_t)1 << slot);
+    while (!list_empty(&expired)) {
+        Timer* timer = expired.next;
+        assert(timer->expires <= tw->now);
+        list_detach(timer);
+        timer->expire(timer);
+    }
+}
+
+void tw_advance(Timer_Wheel* tw, const uint64_t now)
+{
+    while (tw->now < now) {
+        const int64_t timeout = tw_timeout(tw);
+        if (timeout < 0 || tw->now + (uint64_t)timeout > now) {
+            tw->now = now;
+            return;
+        }
+        tw->now += (uint64_t)timeout;
+        tw_tick(tw);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TW_LEVELS       4
+#define TW_SLOT_BITS    6
+#define TW_SLOTS        (1 << TW_SLOT_BITS)
+
+// Intrusive timer; embed it and recover the owner with CONTAINER_OF.
+struct Timer
+{
+    Timer* prev;
+    Timer* next;
+    uint64_t expires;
+    void (*expire)(Timer* timer);
+};
+
+/*
+ * Hierarchical timer wheel with a 1 ms tick. Level `l` has 64 slots of
+ * 64^l ticks each, so 4 levels reach about 4.6 hours ahead; timers further
+ * out are clamped. Adding and removing a timer is O(1), and a per-level
+ * occupancy bitmap finds the next deadline in O(levels) without scanning.
+ */
+struct Timer_Wheel
+{
+    uint64_t now;
+    uint64_t bitmap[TW_LEVELS];
+    Timer slots[TW_LEVELS][TW_SLOTS];
+};
+
+void timer_init(Timer* timer, void (*expire)(Timer* timer));
+bool timer_active(Timer* timer);
+
+void tw_init(Timer_Wheel* tw, uint64_t now);
+// (Re)arms `timer` to fire at `expires`, at the earliest on the next tick.
+void tw_add(Timer_Wheel* tw, Timer* timer, uint64_t expires);
+void tw_del(Timer* timer);
+// Milliseconds until the wheel has work to do, or -1 if it is empty.
+int64_t tw_timeout(Timer_Wheel* tw);
+// Moves the wheel to `now`, running the callbacks of expired timers.
+void tw_advance(Timer_Wheel* tw, uint64_t now);
+
+#endif // __TIMER_H__
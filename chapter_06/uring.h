@@ -0,0 +1,47 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef __linux__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Bare io_uring rings driven through the raw syscalls (no liburing).
+struct Uring
+{
+    int fd;
+    uint32_t features;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned sqe_submitted;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+};
+
+int uring_init(Uring* ring, unsigned entries);
+// Never returns NULL: flushes the queue to the kernel when it is full.
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+// Submits everything queued so far and waits for at least `wait_nr`
+// completions, or until `timeout_ms` passes unless it is negative.
+int uring_submit_and_wait(Uring* ring, unsigned wait_nr, int64_t timeout_ms);
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);
+void uring_cqe_seen(Uring* ring);
+void uring_destroy(Uring* ring);
+
+#endif // __linux__
+
+#endif // __URING_H__
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "hash.h"
+#include "zset.h"
+
+// Smaller batches are not worth sorting.
+#define ZSET_BULK_MIN   16
+
+// A member name borrowed from the request.
+struct ZName
+{
+    const char* data;
+    size_t len;
+};
+
+struct ZNode_Traits
+{
+    static inline bool eq(const ZNode* node, const ZName& key)
+    {
+        return node->len == key.len && 0 == memcmp(node->name, key.data, key.len);
+    }
+};
+
+typedef Hash_Map_T<ZNode, ZName, ZNode_Traits> ZNode_Map;
+
+static inline ZNode* tree_to_znode(AVLNode* tree)
+{
+    return (ZNode*)(tree + 1);
+}
+
+static inline AVLNode* znode_tree(ZNode* node)
+{
+    return (AVLNode*)node - 1;
+}
+
+static ZNode* znode_new(ZSet* zset, const char* name, const size_t len, const double score)
+{
+    const size_t tree_size = zset->engine == ZSET_AVL ? sizeof(AVLNode) : 0;
+    uint8_t* p = (uint8_t*)malloc(tree_size + sizeof(ZNode) + len);
+    if (NULL == p) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    ZNode* node = (ZNode*)(p + tree_size);
+    if (zset->engine == ZSET_AVL) {
+        avl_init(znode_tree(node));
+    }
+    node->node.next = NULL;
+    node->node.hcode = hash_bytes(name, len);
+    node->score = score;
+    node->len = len;
+    memcpy(node->name, name, len);
+    return node;
+}
+
+static void znode_free(ZSet* zset, ZNode* node)
+{
+    free(zset->engine == ZSET_AVL ? (void*)znode_tree(node) : (void*)node);
+}
+
+static inline int name_cmp(const ZNode* node, const char* name, const size_t len)
+{
+    const int rv = memcmp(node->name, name, node->len < len ? node->len : len);
+    return rv != 0 ? rv : (node->len < len ? -1 : (node->len > len ? 1 : 0));
+}
+
+// Orders by score, ties by name.
+static bool znode_less(const ZNode* lhs, const double score, const char* name, const size_t len)
+{
+    if (lhs->score != score) {
+        return lhs->score < score;
+    }
+    return name_cmp(lhs, name, len) < 0;
+}
+
+static bool tree_less(AVLNode* lhs, AVLNode* rhs)
+{
+    const ZNode* node = tree_to_znode(rhs);
+    return znode_less(tree_to_znode(lhs), node->score, node->name, node->len);
+}
+
+// The B+tree compares scores itself and only breaks ties here.
+static int btree_cmp(const void* item, const void* key)
+{
+    const ZName* name = (const ZName*)key;
+    return name_cmp((const ZNode*)item, name->data, name->len);
+}
+
+static void index_insert(ZSet* zset, ZNode* node)
+{
+    if (zset->engine == ZSET_BTREE) {
+        const ZName key = { node->name, node->len };
+        bt_insert(&zset->btree, node->score, &key, node);
+        return;
+    }
+    AVLNode* tree = znode_tree(node);
+    AVLNode* parent = NULL;
+    AVLNode** from = &zset->root;
+    while (*from != NULL) {
+        parent = *from;
+        from = znode_less(tree_to_znode(parent), node->score, node->name, node->len) ? &parent->right : &parent->left;
+    }
+    *from = tree;
+    tree->parent = parent;
+    zset->root = avl_fix(tree);
+}
+
+static void index_delete(ZSet* zset, ZNode* node)
+{
+    if (zset->engine == ZSET_BTREE) {
+        const ZName key = { node->name, node->len };
+        bt_delete(&zset->btree, node->score, &key);
+        return;
+    }
+    zset->root = avl_del(znode_tree(node));
+    avl_init(znode_tree(node));
+}
+
+void zset_init(ZSet* zset, const uint32_t engine)
+{
+    memset(zset, 0, sizeof(*zset));
+    zset->engine = engine;
+    bt_init(&zset->btree, &btree_cmp);
+}
+
+bool zset_insert(ZSet* zset, const char* name, const size_t len, const double score)
+{
+    ZNode* node = zset_lookup(zset, name, len);
+    if (node != NULL) {
+        if (node->score != score) {
+            index_delete(zset, node);
+            node->score = score;
+            index_insert(zset, node);
+        }
+        return false;
+    }
+    node = znode_new(zset, name, len, score);
+    ZNode_Map::insert(&zset->hmap, node);
+    index_insert(zset, node);
+    return true;
+}
+
+// B+tree inserts touch a few wide nodes each, so only the AVL engine
+// takes the bulk path.
+size_t zset_insert_many(ZSet* zset, const ZMember* members, const size_t n)
+{
+    size_t added = 0;
+    if (zset->engine != ZSET_AVL || n < ZSET_BULK_MIN || n < zset_size(zset)) {
+        for (size_t i = 0; i < n; ++i) {
+            added += zset_insert(zset, members[i].name, members[i].len, members[i].score);
+        }
+        return added;
+    }
+
+    // New and moved members are staged out of the tree, marked by depth 0.
+    AVLNode** staged = (AVLNode**)malloc(n * sizeof(AVLNode *));
+    if (NULL == staged) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    size_t nstaged = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const ZMember* member = &members[i];
+        ZNode* node = zset_lookup(zset, member->name, member->len);
+        if (NULL == node) {
+            node = znode_new(zset, member->name, member->len, member->score);
+            ZNode_Map::insert(&zset->hmap, node);
+            ++added;
+        } else if (znode_tree(node)->depth == 0) {
+            node->score = member->score;
+            continue;
+        } else if (node->score == member->score) {
+            continue;
+        } else {
+            zset->root = avl_del(znode_tree(node));
+            node->score = member->score;
+        }
+        znode_tree(node)->depth = 0;
+        staged[nstaged++] = znode_tree(node);
+    }
+    std::sort(staged, staged + nstaged, &tree_less);
+    AVLNode* batch = avl_build(staged, nstaged);
+    zset->root = zset->root != NULL ? avl_merge(zset->root, batch, &tree_less) : batch;
+    free(staged);
+    return added;
+}
+
+ZNode* zset_lookup(ZSet* zset, const char* name, const size_t len)
+{
+    const ZName key = { name, len };
+    return ZNode_Map::lookup(&zset->hmap, key, hash_bytes(name, len));
+}
+
+bool zset_delete(ZSet* zset, const char* name, const size_t len)
+{
+    const ZName key = { name, len };
+    ZNode* node = ZNode_Map::pop(&zset->hmap, key, hash_bytes(name, len));
+    if (NULL == node) {
+        return false;
+    }
+    index_delete(zset, node);
+    znode_free(zset, node);
+    return true;
+}
+
+size_t zset_size(ZSet* zset)
+{
+    return zset->engine == ZSET_BTREE ? zset->btree.size : avl_value(zset->root);
+}
+
+size_t zset_rank(ZSet* zset, ZNode* node)
+{
+    if (zset->engine == ZSET_BTREE) {
+        const ZName key = { node->name, node->len };
+        return (size_t)bt_rank(&zset->btree, node->score, &key);
+    }
+    return (size_t)avl_rank(znode_tree(node));
+}
+
+static inline bool avl_iter(ZIter* it, AVLNode* tree)
+{
+    it->node = tree != NULL ? tree_to_znode(tree) : NULL;
+    return tree != NULL;
+}
+
+static inline bool bt_iter(ZIter* it, const bool found)
+{
+    it->node = found ? (ZNode*)bt_item(&it->bt) : NULL;
+    return found;
+}
+
+bool zset_at(ZSet* zset, const size_t rank, ZIter* it)
+{
+    if (zset->engine == ZSET_BTREE) {
+        return bt_iter(it, bt_at(&zset->btree, rank, &it->bt));
+    }
+    AVLNode* root = zset->root;
+    if (NULL == root) {
+        return avl_iter(it, NULL);
+    }
+    return avl_iter(it, avl_offset(root, (int64_t)rank - avl_value(root->left)));
+}
+
+bool zset_seekge(ZSet* zset, const double score, const char* name, const size_t len, ZIter* it)
+{
+    if (zset->engine == ZSET_BTREE) {
+        const ZName key = { name, len };
+        return bt_iter(it, bt_seekge(&zset->btree, score, &key, &it->bt));
+    }
+    AVLNode* found = NULL;
+    for (AVLNode* tree = zset->root; tree != NULL;) {
+        if (znode_less(tree_to_znode(tree), score, name, len)) {
+            tree = tree->right;
+        } else {
+            found = tree;
+            tree = tree->left;
+        }
+    }
+    return avl_iter(it, found);
+}
+
+bool zset_offset(ZSet* zset, ZIter* it, const int64_t offset)
+{
+    if (zset->engine == ZSET_BTREE) {
+        return bt_iter(it, bt_offset(&zset->btree, &it->bt, offset));
+    }
+    return avl_iter(it, avl_offset(znode_tree(it->node), offset));
+}
+
+bool zset_next(ZSet* zset, ZIter* it)
+{
+    if (zset->engine == ZSET_BTREE) {
+        return bt_iter(it, bt_next(&it->bt));
+    }
+    AVLNode* tree = znode_tree(it->node);
+    if (tree->right != NULL) {
+        for (tree = tree->right; tree->left != NULL; tree = tree->left) {
+        }
+        return avl_iter(it, tree);
+    }
+    while (tree->parent != NULL && tree == tree->parent->right) {
+        tree = tree->parent;
+    }
+    return avl_iter(it, tree->parent);
+}
+
+static void tree_free(AVLNode* tree)
+{
+    if (NULL == tree) {
+        return;
+    }
+    tree_free(tree->left);
+    tree_free(tree->right);
+    free(tree);
+}
+
+void zset_clear(ZSet* zset)
+{
+    if (zset->engine == ZSET_BTREE) {
+        BIter it;
+        for (bool more = bt_at(&zset->btree, 0, &it); more; more = bt_next(&it)) {
+            free(bt_item(&it));
+        }
+        bt_destroy(&zset->btree);
+    } else {
+        tree_free(zset->root);
+        zset->root = NULL;
+    }
+    hm_destroy(&zset->hmap);
+}
@@ -0,0 +1,81 @@
+#ifndef __ZSET_H__
+#define __ZSET_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../chapter_07/avl.h"
+#include "../chapter_07/btree.h"
+#include "hashtable.h"
+
+/*
+ * Sorted set: every member sits in an ordered index by (score, name) and
+ * in a hash map keyed by name. The map answers score lookups in O(1); the
+ * index keeps counts that make ranks and positions O(log n). The index is
+ * an AVL tree or a B+tree, picked per set when it is created.
+ */
+enum
+{
+    ZSET_AVL   = 0,
+    ZSET_BTREE = 1,
+};
+
+struct ZSet
+{
+    uint32_t engine;
+    // ZSET_AVL
+    AVLNode* root;
+    // ZSET_BTREE
+    BTree btree;
+    Hash_Map hmap;
+};
+
+// Under ZSET_AVL each member's AVLNode comes right before it in the same
+// allocation; a B+tree keeps only pointers to the members in its leaves.
+struct ZNode
+{
+    Hash_Node node;
+    double score;
+    size_t len;
+    char name[];
+};
+
+struct ZMember
+{
+    const char* name;
+    size_t len;
+    double score;
+};
+
+// A position in a set; `node` is NULL past either end.
+struct ZIter
+{
+    ZNode* node;
+    BIter bt;
+};
+
+void zset_init(ZSet* zset, uint32_t engine);
+// Adds the member or moves it to `score`; true if it is new.
+bool zset_insert(ZSet* zset, const char* name, size_t len, double score);
+// Same as zset_insert on each member in turn; returns how many are new.
+// A batch at least as big as an AVL set is sorted and merged into the tree
+// in one pass instead of being inserted node by node.
+size_t zset_insert_many(ZSet* zset, const ZMember* members, size_t n);
+ZNode* zset_lookup(ZSet* zset, const char* name, size_t len);
+// False if there is no such member.
+bool zset_delete(ZSet* zset, const char* name, size_t len);
+size_t zset_size(ZSet* zset);
+// Members before `node` in order.
+size_t zset_rank(ZSet* zset, ZNode* node);
+// Points `it` at the member at `rank` counting from 0.
+bool zset_at(ZSet* zset, size_t rank, ZIter* it);
+// Points `it` at the first member not ordered before (score, name).
+bool zset_seekge(ZSet* zset, double score, const char* name, size_t len, ZIter* it);
+// Moves `it` by `offset` members, backwards if negative.
+bool zset_offset(ZSet* zset, ZIter* it, int64_t offset);
+// Steps `it` to the next member in order.
+bool zset_next(ZSet* zset, ZIter* it);
+// Frees every member.
+void zset_clear(ZSet* zset);
+
+#endif // __ZSET_H__
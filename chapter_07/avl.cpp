@@ -223,4 +223,159 @@ AVLNode* avl_del(AVLNode* node)
     }
 }
 
+/*
+ * Offset Traversal Using the Subtree Counts
+ *
+ * `pos` is the position of the current node relative to the starting node.
+ * Moving to a child changes it by the count of the subtree skipped over:
+ * going right passes the right child's left subtree and the node itself,
+ * going left passes the left child's right subtree and the node itself.
+ * Moving to the parent does the reverse.
+ *
+ * While the target is inside the current node's subtree we descend towards
+ * it, otherwise we climb. We climb at most to the lowest common ancestor of
+ * the two nodes and then descend from it, so the walk is O(log n) whatever
+ * the offset, instead of `offset` steps of an in-order successor.
+ */
+AVLNode* avl_offset(AVLNode* node, int64_t offset)
+{
+    int64_t pos = 0;
+    while (offset != pos) {
+        if (pos < offset && pos + avl_value(node->right) >= offset) {
+            node = node->right;
+            pos += avl_value(node->left) + 1;
+        } else if (pos > offset && pos - avl_value(node->left) <= offset) {
+            node = node->left;
+            pos -= avl_value(node->right) + 1;
+        } else {
+            AVLNode* parent = node->parent;
+            if (!parent) {
+                return NULL;
+            }
+            if (parent->right == node) {
+                pos -= avl_value(node->left) + 1;
+            } else {
+                pos += avl_value(node->right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+/*
+ * The rank is the number of nodes before `node` in order: its left subtree,
+ * plus, for every ancestor reached from its right child, that ancestor and
+ * its left subtree.
+ */
+int64_t avl_rank(AVLNode* node)
+{
+    int64_t rank = avl_value(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_value(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+/*
+ * Bulk Construction
+ *
+ * Inserting n sorted nodes one by one costs O(n log n) and rotates all the
+ * way. When the order is already known, the tree can be laid out directly:
+ * the middle node becomes the root and each half becomes one of its
+ * subtrees, recursively. The halves differ in size by at most one, and so
+ * do their depths, so the result is a valid AVL tree, as shallow as any
+ * tree of n nodes can be. Every node is visited once: O(n).
+ */
+static AVLNode* build_array(AVLNode** nodes, const size_t n, AVLNode* parent)
+{
+    if (n == 0) {
+        return NULL;
+    }
+    const size_t mid = n / 2;
+    AVLNode* node = nodes[mid];
+    node->parent = parent;
+    node->left = build_array(nodes, mid, node);
+    node->right = build_array(nodes + mid + 1, n - mid - 1, node);
+    avl_update(node);
+    return node;
+}
+
+AVLNode* avl_build(AVLNode** nodes, size_t n)
+{
+    return build_array(nodes, n, NULL);
+}
+
+/*
+ * Merging reuses the same layout, but works on in-order lists threaded
+ * through the `right` links, so no array has to be allocated:
+ * 1. Flatten each tree into a list, in order.
+ * 2. Merge the two sorted lists, like merge sort does.
+ * 3. Build from the list: the first n / 2 nodes become the left subtree,
+ *    the next one the root, the rest the right subtree. Consuming the list
+ *    front to back builds the tree in order, left subtrees first.
+ */
+static void flatten(AVLNode* node, AVLNode*** tail)
+{
+    if (node == NULL) {
+        return;
+    }
+    // The left subtree is done before node->right is overwritten.
+    AVLNode* right = node->right;
+    flatten(node->left, tail);
+    **tail = node;
+    *tail = &node->right;
+    flatten(right, tail);
+}
 
+static AVLNode* build_list(AVLNode** list, const size_t n)
+{
+    if (n == 0) {
+        return NULL;
+    }
+    AVLNode* left = build_list(list, n / 2);
+    AVLNode* node = *list;
+    *list = node->right;
+    AVLNode* right = build_list(list, n - n / 2 - 1);
+    node->left = left;
+    node->right = right;
+    node->parent = NULL;
+    if (left) {
+        left->parent = node;
+    }
+    if (right) {
+        right->parent = node;
+    }
+    avl_update(node);
+    return node;
+}
+
+AVLNode* avl_merge(AVLNode* lhs, AVLNode* rhs, bool (*less)(AVLNode*, AVLNode*))
+{
+    const size_t n = (size_t)avl_value(lhs) + avl_value(rhs);
+    AVLNode* a = NULL;
+    AVLNode* b = NULL;
+    AVLNode** tail = &a;
+    flatten(lhs, &tail);
+    *tail = NULL;
+    tail = &b;
+    flatten(rhs, &tail);
+    *tail = NULL;
+
+    AVLNode* list = NULL;
+    tail = &list;
+    while (a && b) {
+        if (less(b, a)) {
+            *tail = b;
+            b = b->right;
+        } else {
+            *tail = a;
+            a = a->right;
+        }
+        tail = &(*tail)->right;
+    }
+    *tail = a ? a : b;
+    return build_list(&list, n);
+}
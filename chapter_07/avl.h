@@ -18,6 +18,17 @@ uint32_t avl_depth(AVLNode* node);
 uint32_t avl_value(AVLNode* node);
 AVLNode* avl_del(AVLNode* node);
 AVLNode* avl_fix(AVLNode* node);
+// The node `offset` places after `node` in order, before it if negative;
+// NULL if that is outside the tree. O(log n) through the subtree counts.
+AVLNode* avl_offset(AVLNode* node, int64_t offset);
+// Position of `node` in its tree, from 0.
+int64_t avl_rank(AVLNode* node);
+// Links nodes[0..n), already in order, into a balanced tree in O(n);
+// returns the root. The nodes' links and counts are all overwritten.
+AVLNode* avl_build(AVLNode** nodes, size_t n);
+// Joins the nodes of two trees into one balanced tree in O(n + m), ordered
+// by `less`; of equal nodes, those of `lhs` come first. Returns the root.
+AVLNode* avl_merge(AVLNode* lhs, AVLNode* rhs, bool (*less)(AVLNode*, AVLNode*));
 
 #endif // __AVL_H__
 
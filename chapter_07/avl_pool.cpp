@@ -0,0 +1,322 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avl_pool.h"
+
+#define AP_MIN_CAP  16
+
+static void* ap_realloc(void* p, const size_t size)
+{
+    p = realloc(p, size);
+    if (NULL == p) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    return p;
+}
+
+void ap_init(AVLPool* pool, const size_t data_size)
+{
+    // Data that needs 8-byte alignment gets it from an 8-byte stride.
+    const uint32_t node_off = (uint32_t)((data_size + 3) & ~(size_t)3);
+    const uint32_t align = (data_size % 8 == 0 && data_size > 0) ? 8 : 4;
+    pool->node_off = node_off;
+    pool->stride = (uint32_t)((node_off + sizeof(APNode) + align - 1) & ~(align - 1));
+    pool->cap = AP_MIN_CAP;
+    pool->slots = (uint8_t*)ap_realloc(NULL, (size_t)pool->cap * pool->stride);
+    memset(pool->slots, 0, pool->stride);
+    pool->used = 1;
+    pool->free_list = 0;
+    pool->nfree = 0;
+}
+
+void ap_destroy(AVLPool* pool)
+{
+    free(pool->slots);
+    pool->slots = NULL;
+    pool->cap = pool->used = pool->nfree = pool->free_list = 0;
+}
+
+uint32_t ap_alloc(AVLPool* pool)
+{
+    uint32_t node = pool->free_list;
+    if (node != 0) {
+        pool->free_list = ap_node(pool, node)->left;
+        --pool->nfree;
+    } else {
+        if (pool->used == pool->cap) {
+            if (pool->cap > UINT32_MAX / 2) {
+                fprintf(stderr, "out of memory\n");
+                abort();
+            }
+            pool->cap *= 2;
+            pool->slots = (uint8_t*)ap_realloc(pool->slots, (size_t)pool->cap * pool->stride);
+        }
+        node = pool->used++;
+    }
+    APNode* n = ap_node(pool, node);
+    n->depth = 1;
+    n->value = 1;
+    n->left = n->right = n->parent = 0;
+    return node;
+}
+
+void ap_free(AVLPool* pool, const uint32_t node)
+{
+    APNode* n = ap_node(pool, node);
+    n->depth = 0;
+    n->left = pool->free_list;
+    pool->free_list = node;
+    ++pool->nfree;
+}
+
+uint32_t ap_live(AVLPool* pool)
+{
+    return pool->used - 1 - pool->nfree;
+}
+
+// Slot 0 is all zeroes, so reading it needs no branch.
+uint32_t ap_depth(AVLPool* pool, const uint32_t node)
+{
+    return ap_node(pool, node)->depth;
+}
+
+uint32_t ap_value(AVLPool* pool, const uint32_t node)
+{
+    return ap_node(pool, node)->value;
+}
+
+static inline uint32_t max(uint32_t lhs, uint32_t rhs)
+{
+    return lhs < rhs ? rhs : lhs;
+}
+
+static inline void ap_update(AVLPool* pool, const uint32_t node)
+{
+    APNode* n = ap_node(pool, node);
+    n->depth = 1 + max(ap_depth(pool, n->left), ap_depth(pool, n->right));
+    n->value = 1 + ap_value(pool, n->left) + ap_value(pool, n->right);
+}
+
+// The rotations and fixes are those of avl.cpp, one for one, with slot 0
+// in place of NULL. Slot 0 is only ever read, never linked to.
+static uint32_t rotate_left(AVLPool* pool, const uint32_t node)
+{
+    APNode* n = ap_node(pool, node);
+    const uint32_t new_node = n->right;
+    APNode* nn = ap_node(pool, new_node);
+    if (nn->left) {
+        ap_node(pool, nn->left)->parent = node;
+    }
+    n->right = nn->left;
+    nn->left = node;
+    nn->parent = n->parent;
+    n->parent = new_node;
+    ap_update(pool, node);
+    ap_update(pool, new_node);
+    return new_node;
+}
+
+static uint32_t rotate_right(AVLPool* pool, const uint32_t node)
+{
+    APNode* n = ap_node(pool, node);
+    const uint32_t new_node = n->left;
+    APNode* nn = ap_node(pool, new_node);
+    if (nn->right) {
+        ap_node(pool, nn->right)->parent = node;
+    }
+    n->left = nn->right;
+    nn->right = node;
+    nn->parent = n->parent;
+    n->parent = new_node;
+    ap_update(pool, node);
+    ap_update(pool, new_node);
+    return new_node;
+}
+
+static uint32_t fix_left(AVLPool* pool, const uint32_t root)
+{
+    APNode* r = ap_node(pool, root);
+    const APNode* left = ap_node(pool, r->left);
+    if (ap_depth(pool, left->left) < ap_depth(pool, left->right)) {
+        r->left = rotate_left(pool, r->left);
+    }
+    return rotate_right(pool, root);
+}
+
+static uint32_t fix_right(AVLPool* pool, const uint32_t root)
+{
+    APNode* r = ap_node(pool, root);
+    const APNode* right = ap_node(pool, r->right);
+    if (ap_depth(pool, right->right) < ap_depth(pool, right->left)) {
+        r->right = rotate_right(pool, r->right);
+    }
+    return rotate_left(pool, root);
+}
+
+uint32_t ap_fix(AVLPool* pool, uint32_t node)
+{
+    while (true) {
+        ap_update(pool, node);
+        const APNode* n = ap_node(pool, node);
+        const uint32_t left_depth = ap_depth(pool, n->left);
+        const uint32_t right_depth = ap_depth(pool, n->right);
+        uint32_t* from = NULL;
+        if (n->parent) {
+            APNode* parent = ap_node(pool, n->parent);
+            from = parent->left == node ? &parent->left : &parent->right;
+        }
+        if (left_depth == right_depth + 2) {
+            node = fix_left(pool, node);
+        } else if (right_depth == left_depth + 2) {
+            node = fix_right(pool, node);
+        }
+        if (!from) {
+            return node;
+        }
+        *from = node;
+        node = ap_node(pool, node)->parent;
+    }
+
+    assert(false);
+    return 0;
+}
+
+uint32_t ap_del(AVLPool* pool, const uint32_t node)
+{
+    APNode* n = ap_node(pool, node);
+    if (n->right == 0) {
+        const uint32_t parent = n->parent;
+        if (n->left) {
+            ap_node(pool, n->left)->parent = parent;
+        }
+        if (parent) {
+            APNode* p = ap_node(pool, parent);
+            (p->left == node ? p->left : p->right) = n->left;
+            return ap_fix(pool, parent);
+        }
+        return n->left;
+    }
+    uint32_t victim = n->right;
+    while (ap_node(pool, victim)->left) {
+        victim = ap_node(pool, victim)->left;
+    }
+    const uint32_t root = ap_del(pool, victim);
+    APNode* v = ap_node(pool, victim);
+    *v = *n;
+    if (v->left) {
+        ap_node(pool, v->left)->parent = victim;
+    }
+    if (v->right) {
+        ap_node(pool, v->right)->parent = victim;
+    }
+    if (n->parent) {
+        APNode* p = ap_node(pool, n->parent);
+        (p->left == node ? p->left : p->right) = victim;
+        return root;
+    }
+    return victim;
+}
+
+// Same walk as avl_offset.
+uint32_t ap_offset(AVLPool* pool, uint32_t node, const int64_t offset)
+{
+    int64_t pos = 0;
+    while (offset != pos) {
+        const APNode* n = ap_node(pool, node);
+        if (pos < offset && pos + ap_value(pool, n->right) >= offset) {
+            node = n->right;
+            pos += ap_value(pool, ap_node(pool, node)->left) + 1;
+        } else if (pos > offset && pos - ap_value(pool, n->left) <= offset) {
+            node = n->left;
+            pos -= ap_value(pool, ap_node(pool, node)->right) + 1;
+        } else {
+            const uint32_t parent = n->parent;
+            if (!parent) {
+                return 0;
+            }
+            if (ap_node(pool, parent)->right == node) {
+                pos -= ap_value(pool, n->left) + 1;
+            } else {
+                pos += ap_value(pool, n->right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+int64_t ap_rank(AVLPool* pool, uint32_t node)
+{
+    int64_t rank = ap_value(pool, ap_node(pool, node)->left);
+    for (uint32_t parent = ap_node(pool, node)->parent; parent; parent = ap_node(pool, node)->parent) {
+        const APNode* p = ap_node(pool, parent);
+        if (p->right == node) {
+            rank += ap_value(pool, p->left) + 1;
+        }
+        node = parent;
+    }
+    return rank;
+}
+
+/*
+ * Compaction
+ *
+ * Deletes leave holes that only new nodes fill, and after many updates
+ * neighbours in order sit far apart in the array. Compaction copies the
+ * data out in order into a fresh array of exactly n + 1 slots, then lays
+ * the links over it the way avl_build does: the middle slot of a range
+ * is its root, the halves its subtrees. The copy reads the old tree once
+ * and the links need no lookup, since slot i + 1 is simply rank i.
+ */
+static uint32_t build_range(AVLPool* pool, const uint32_t lo, const uint32_t hi, const uint32_t parent)
+{
+    if (lo == hi) {
+        return 0;
+    }
+    const uint32_t mid = lo + (hi - lo) / 2;
+    APNode* n = ap_node(pool, mid);
+    n->parent = parent;
+    n->left = build_range(pool, lo, mid, mid);
+    n->right = build_range(pool, mid + 1, hi, mid);
+    ap_update(pool, mid);
+    return mid;
+}
+
+uint32_t ap_compact(AVLPool* pool, uint32_t root)
+{
+    const uint32_t n = ap_value(pool, root);
+    assert(n == ap_live(pool));
+    const uint32_t cap = n + 1 < AP_MIN_CAP ? AP_MIN_CAP : n + 1;
+    uint8_t* slots = (uint8_t*)ap_realloc(NULL, (size_t)cap * pool->stride);
+    memset(slots, 0, pool->stride);
+
+    // In-order successor walk; no stack needed thanks to the parent links.
+    uint32_t node = root;
+    while (node && ap_node(pool, node)->left) {
+        node = ap_node(pool, node)->left;
+    }
+    for (uint32_t i = 1; node; ++i) {
+        memcpy(slots + (size_t)i * pool->stride, ap_data(pool, node), pool->node_off);
+        const APNode* cur = ap_node(pool, node);
+        if (cur->right) {
+            for (node = cur->right; ap_node(pool, node)->left; node = ap_node(pool, node)->left) {
+            }
+            continue;
+        }
+        while (ap_node(pool, node)->parent && ap_node(pool, ap_node(pool, node)->parent)->right == node) {
+            node = ap_node(pool, node)->parent;
+        }
+        node = ap_node(pool, node)->parent;
+    }
+
+    free(pool->slots);
+    pool->slots = slots;
+    pool->cap = cap;
+    pool->used = n + 1;
+    pool->free_list = 0;
+    pool->nfree = 0;
+    return build_range(pool, 1, n + 1, 0);
+}
@@ -0,0 +1,75 @@
+#ifndef __AVL_POOL_H__
+#define __AVL_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * AVL tree whose nodes live in one growable array and link to each other
+ * by 32-bit slot index instead of by pointer: 20 bytes a node against the
+ * 32 of AVLNode. The caller's data shares the node's slot, so there is no
+ * allocation per node either. Slot 0 is never handed out and stands for
+ * NULL. Freed slots are reused through a free list; ap_compact packs the
+ * tree into slots 1..n in order, after which an in-order walk reads the
+ * array front to back.
+ *
+ * The array moves when it grows: pointers from ap_node and ap_data are
+ * only good until the next ap_alloc or ap_compact. Indices stay valid
+ * until ap_compact.
+ */
+struct APNode
+{
+    uint32_t depth;
+    uint32_t value;
+    uint32_t left;
+    uint32_t right;
+    uint32_t parent;
+};
+
+struct AVLPool
+{
+    // Slot i holds the data at slots + i * stride, the APNode after it.
+    uint8_t* slots;
+    uint32_t stride;
+    uint32_t node_off;
+    uint32_t cap;
+    // Slots handed out so far, slot 0 included.
+    uint32_t used;
+    // Freed slots, linked through `left`.
+    uint32_t free_list;
+    uint32_t nfree;
+};
+
+static inline APNode* ap_node(AVLPool* pool, const uint32_t node)
+{
+    return (APNode*)(pool->slots + (size_t)node * pool->stride + pool->node_off);
+}
+
+static inline void* ap_data(AVLPool* pool, const uint32_t node)
+{
+    return pool->slots + (size_t)node * pool->stride;
+}
+
+// Every slot carries `data_size` bytes for the caller.
+void ap_init(AVLPool* pool, size_t data_size);
+void ap_destroy(AVLPool* pool);
+// A detached node, like one after avl_init; its data is not initialized.
+uint32_t ap_alloc(AVLPool* pool);
+// Returns a node that is no longer in the tree to the pool.
+void ap_free(AVLPool* pool, uint32_t node);
+// Nodes handed out and not freed.
+uint32_t ap_live(AVLPool* pool);
+// The counterparts of the avl_* functions, on indices; 0 is NULL.
+uint32_t ap_depth(AVLPool* pool, uint32_t node);
+uint32_t ap_value(AVLPool* pool, uint32_t node);
+uint32_t ap_fix(AVLPool* pool, uint32_t node);
+uint32_t ap_del(AVLPool* pool, uint32_t node);
+uint32_t ap_offset(AVLPool* pool, uint32_t node, int64_t offset);
+int64_t ap_rank(AVLPool* pool, uint32_t node);
+// Moves the tree at `root`, which must hold every live node, into slots
+// 1..n in order and relinks it balanced; the array shrinks to fit.
+// Returns the new root. Every index changes: slot i + 1 holds the node
+// that had rank i.
+uint32_t ap_compact(AVLPool* pool, uint32_t root);
+
+#endif // __AVL_POOL_H__
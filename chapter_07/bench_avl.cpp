@@ -0,0 +1,471 @@
+// Benchmarks of the tree operations that use the subtree counts or skip
+// the per-node rebalancing, against the naive way of doing the same, and
+// of the AVL tree against the B+tree and the pooled AVL tree.
+//
+//   g++ -O2 bench_avl.cpp avl.cpp avl_pool.cpp btree.cpp -o bench_avl
+//   ./bench_avl offset
+//   ./bench_avl build
+//   ./bench_avl btree
+//   ./bench_avl pool
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "avl.h"
+#include "avl_pool.h"
+#include "btree.h"
+
+#define NODES   (1 << 20)
+#define SEEKS   20000
+#define ITEMS   10000000
+
+static uint64_t bench_nsec()
+{
+    struct timespec tv = {};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_nsec;
+}
+
+static AVLNode* next(AVLNode* node)
+{
+    if (node->right) {
+        for (node = node->right; node->left; node = node->left) {
+        }
+        return node;
+    }
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+static AVLNode* step(AVLNode* node, int64_t offset)
+{
+    for (; node && offset > 0; --offset) {
+        node = next(node);
+    }
+    return node;
+}
+
+// Nodes are ordered by address, so a vector of them is sorted.
+static AVLNode* insert(AVLNode* root, AVLNode* node)
+{
+    avl_init(node);
+    AVLNode* parent = NULL;
+    AVLNode** from = &root;
+    while (*from) {
+        parent = *from;
+        from = node < parent ? &parent->left : &parent->right;
+    }
+    *from = node;
+    node->parent = parent;
+    return avl_fix(node);
+}
+
+static bool less(AVLNode* lhs, AVLNode* rhs)
+{
+    return lhs < rhs;
+}
+
+// Seeking by offset through the subtree counts against stepping node by
+// node, for the offsets a paginated range query skips.
+static void bench_offset()
+{
+    // Keys are the slot numbers, inserted in a shuffled order so the tree
+    // is shaped by rebalancing rather than by one sorted run.
+    std::vector<AVLNode> nodes(NODES);
+    std::vector<uint32_t> order(NODES);
+    for (uint32_t i = 0; i < NODES; ++i) {
+        order[i] = i;
+    }
+    srand(1);
+    for (uint32_t i = NODES - 1; i > 0; --i) {
+        const uint32_t j = (uint32_t)rand() % (i + 1);
+        const uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    AVLNode* root = NULL;
+    for (uint32_t i = 0; i < NODES; ++i) {
+        root = insert(root, &nodes[order[i]]);
+    }
+
+    std::vector<AVLNode*> starts(SEEKS);
+    for (uint32_t i = 0; i < SEEKS; ++i) {
+        starts[i] = &nodes[(uint32_t)rand() % (NODES / 2)];
+    }
+    printf("%d nodes, %d seeks from random members\n", NODES, SEEKS);
+    for (int64_t offset = 1; offset <= 100000; offset *= 10) {
+        uint64_t check = 0;
+        uint64_t begin = bench_nsec();
+        for (uint32_t i = 0; i < SEEKS; ++i) {
+            check += (uintptr_t)avl_offset(starts[i], offset);
+        }
+        const uint64_t seek_ns = bench_nsec() - begin;
+
+        begin = bench_nsec();
+        for (uint32_t i = 0; i < SEEKS; ++i) {
+            check -= (uintptr_t)step(starts[i], offset);
+        }
+        const uint64_t step_ns = bench_nsec() - begin;
+        if (check != 0) {
+            fprintf(stderr, "avl_offset and stepping disagree\n");
+            exit(1);
+        }
+        printf("offset %6lld: avl_offset %8.1f ns  stepping %10.1f ns\n",
+               (long long)offset, (double)seek_ns / SEEKS, (double)step_ns / SEEKS);
+    }
+}
+
+// Loading sorted nodes, and joining two trees of interleaved keys, with
+// one insert per node against avl_build and avl_merge.
+static void bench_build()
+{
+    std::vector<AVLNode> nodes(NODES);
+    std::vector<AVLNode*> sorted(NODES);
+    for (uint32_t i = 0; i < NODES; ++i) {
+        sorted[i] = &nodes[i];
+    }
+    printf("%d nodes\n", NODES);
+
+    uint64_t begin = bench_nsec();
+    AVLNode* root = NULL;
+    for (uint32_t i = 0; i < NODES; ++i) {
+        root = insert(root, sorted[i]);
+    }
+    const uint64_t insert_ns = bench_nsec() - begin;
+    const uint32_t insert_depth = avl_depth(root);
+    begin = bench_nsec();
+    root = avl_build(sorted.data(), NODES);
+    const uint64_t build_ns = bench_nsec() - begin;
+    printf("load sorted:  insert %6.1f ms (depth %u)  avl_build %6.1f ms (depth %u)\n",
+           insert_ns / 1e6, insert_depth, build_ns / 1e6, avl_depth(root));
+
+    // Even slots in one tree, odd ones in the other.
+    std::vector<AVLNode*> even(NODES / 2);
+    std::vector<AVLNode*> odd(NODES / 2);
+    for (uint32_t i = 0; i < NODES / 2; ++i) {
+        even[i] = &nodes[2 * i];
+        odd[i] = &nodes[2 * i + 1];
+    }
+    AVLNode* lhs = avl_build(even.data(), NODES / 2);
+    begin = bench_nsec();
+    for (uint32_t i = 0; i < NODES / 2; ++i) {
+        lhs = insert(lhs, odd[i]);
+    }
+    const uint64_t join_ns = bench_nsec() - begin;
+    lhs = avl_build(even.data(), NODES / 2);
+    AVLNode* rhs = avl_build(odd.data(), NODES / 2);
+    begin = bench_nsec();
+    root = avl_merge(lhs, rhs, &less);
+    const uint64_t merge_ns = bench_nsec() - begin;
+    AVLNode* first = root;
+    while (first->left) {
+        first = first->left;
+    }
+    if (avl_value(root) != NODES || avl_offset(first, NODES / 3) != &nodes[NODES / 3]) {
+        fprintf(stderr, "avl_merge lost the order\n");
+        exit(1);
+    }
+    printf("merge halves: insert %6.1f ms              avl_merge %6.1f ms (depth %u)\n",
+           join_ns / 1e6, merge_ns / 1e6, avl_depth(root));
+}
+
+// A sorted-set member as each index sees it: the AVL tree is intrusive,
+// the B+tree holds pointers to items that do not know about it.
+struct Item
+{
+    AVLNode tree;
+    double score;
+    uint32_t id;
+};
+
+static inline bool item_less(const Item* lhs, const Item* rhs)
+{
+    return lhs->score < rhs->score || (lhs->score == rhs->score && lhs->id < rhs->id);
+}
+
+static AVLNode* item_insert(AVLNode* root, Item* item)
+{
+    avl_init(&item->tree);
+    AVLNode* parent = NULL;
+    AVLNode** from = &root;
+    while (*from) {
+        parent = *from;
+        from = item_less(item, (Item*)parent) ? &parent->left : &parent->right;
+    }
+    *from = &item->tree;
+    item->tree.parent = parent;
+    return avl_fix(&item->tree);
+}
+
+static int item_cmp(const void* item, const void* key)
+{
+    const uint32_t lhs = ((const Item*)item)->id;
+    const uint32_t rhs = ((const Item*)key)->id;
+    return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+
+// The same random inserts, an in-order scan of everything and random rank
+// lookups on both indexes. Index bytes are the AVLNode in each item against
+// the B+tree nodes.
+static void bench_btree()
+{
+    std::vector<Item> items(ITEMS);
+    srand(1);
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        items[i].score = (double)(rand() % (ITEMS / 4));
+        items[i].id = i;
+    }
+    std::vector<uint64_t> ranks(SEEKS);
+    for (uint32_t i = 0; i < SEEKS; ++i) {
+        ranks[i] = (uint64_t)rand() % ITEMS;
+    }
+    printf("%d items, %d rank lookups\n", ITEMS, SEEKS);
+
+    uint64_t begin = bench_nsec();
+    AVLNode* root = NULL;
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        root = item_insert(root, &items[i]);
+    }
+    const uint64_t avl_insert_ns = bench_nsec() - begin;
+    begin = bench_nsec();
+    double avl_sum = 0;
+    AVLNode* node = root;
+    while (node->left) {
+        node = node->left;
+    }
+    for (; node; node = next(node)) {
+        avl_sum += ((Item*)node)->score;
+    }
+    const uint64_t avl_scan_ns = bench_nsec() - begin;
+    begin = bench_nsec();
+    uint64_t check = 0;
+    for (uint32_t i = 0; i < SEEKS; ++i) {
+        check += ((Item*)avl_offset(root, (int64_t)ranks[i] - avl_value(root->left)))->id;
+    }
+    const uint64_t avl_rank_ns = bench_nsec() - begin;
+
+    BTree tree;
+    bt_init(&tree, &item_cmp);
+    begin = bench_nsec();
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        bt_insert(&tree, items[i].score, &items[i], &items[i]);
+    }
+    const uint64_t bt_insert_ns = bench_nsec() - begin;
+    begin = bench_nsec();
+    double bt_sum = 0;
+    BIter it;
+    for (bool more = bt_at(&tree, 0, &it); more; more = bt_next(&it)) {
+        bt_sum += ((Item*)bt_item(&it))->score;
+    }
+    const uint64_t bt_scan_ns = bench_nsec() - begin;
+    begin = bench_nsec();
+    for (uint32_t i = 0; i < SEEKS; ++i) {
+        bt_at(&tree, ranks[i], &it);
+        check -= ((Item*)bt_item(&it))->id;
+    }
+    const uint64_t bt_rank_ns = bench_nsec() - begin;
+    if (check != 0 || avl_sum != bt_sum) {
+        fprintf(stderr, "the AVL tree and the B+tree disagree\n");
+        exit(1);
+    }
+
+    printf("index bytes/item: avl %6.1f    btree %6.1f\n",
+           (double)sizeof(AVLNode), (double)bt_bytes(&tree) / ITEMS);
+    printf("insert ns/item:   avl %6.1f    btree %6.1f\n",
+           (double)avl_insert_ns / ITEMS, (double)bt_insert_ns / ITEMS);
+    printf("scan ns/item:     avl %6.1f    btree %6.1f\n",
+           (double)avl_scan_ns / ITEMS, (double)bt_scan_ns / ITEMS);
+    printf("rank ns/lookup:   avl %6.1f    btree %6.1f\n",
+           (double)avl_rank_ns / SEEKS, (double)bt_rank_ns / SEEKS);
+    bt_destroy(&tree);
+}
+
+// The node layout of test_avl.cpp: one allocation per value.
+struct Data
+{
+    AVLNode node;
+    uint32_t value;
+};
+
+static AVLNode* data_insert(AVLNode* root, Data* data)
+{
+    avl_init(&data->node);
+    AVLNode* parent = NULL;
+    AVLNode** from = &root;
+    while (*from) {
+        parent = *from;
+        from = data->value < ((Data*)parent)->value ? &parent->left : &parent->right;
+    }
+    *from = &data->node;
+    data->node.parent = parent;
+    return avl_fix(&data->node);
+}
+
+static uint32_t pool_insert(AVLPool* pool, uint32_t root, const uint32_t value)
+{
+    const uint32_t node = ap_alloc(pool);
+    *(uint32_t*)ap_data(pool, node) = value;
+    uint32_t parent = 0;
+    uint32_t* from = &root;
+    while (*from) {
+        parent = *from;
+        APNode* n = ap_node(pool, parent);
+        from = value < *(uint32_t*)ap_data(pool, parent) ? &n->left : &n->right;
+    }
+    *from = node;
+    ap_node(pool, node)->parent = parent;
+    return ap_fix(pool, node);
+}
+
+static uint32_t pool_next(AVLPool* pool, uint32_t node)
+{
+    const APNode* n = ap_node(pool, node);
+    if (n->right) {
+        for (node = n->right; ap_node(pool, node)->left; node = ap_node(pool, node)->left) {
+        }
+        return node;
+    }
+    while (ap_node(pool, node)->parent && ap_node(pool, ap_node(pool, node)->parent)->right == node) {
+        node = ap_node(pool, node)->parent;
+    }
+    return ap_node(pool, node)->parent;
+}
+
+// Large blocks are mmapped, so they count apart from the arena.
+static size_t heap_bytes()
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static uint64_t scan_avl(AVLNode* root)
+{
+    uint64_t sum = 0;
+    AVLNode* node = root;
+    while (node->left) {
+        node = node->left;
+    }
+    for (; node; node = next(node)) {
+        sum += ((Data*)node)->value;
+    }
+    return sum;
+}
+
+static uint64_t scan_pool(AVLPool* pool, const uint32_t root)
+{
+    uint64_t sum = 0;
+    uint32_t node = root;
+    while (ap_node(pool, node)->left) {
+        node = ap_node(pool, node)->left;
+    }
+    for (; node; node = pool_next(pool, node)) {
+        sum += *(uint32_t*)ap_data(pool, node);
+    }
+    return sum;
+}
+
+// Heap bytes per value, insert and in-order scan time for a tree of
+// separately allocated nodes against the pool. Half the values are then
+// deleted and replaced, which scatters neighbours through the array, and
+// the pool is scanned again before and after ap_compact.
+static void bench_pool()
+{
+    std::vector<uint32_t> values(ITEMS);
+    srand(1);
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        values[i] = (uint32_t)rand();
+    }
+    printf("%d values\n", ITEMS);
+
+    std::vector<Data*> datas(ITEMS);
+    size_t heap = heap_bytes();
+    uint64_t begin = bench_nsec();
+    AVLNode* root = NULL;
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        datas[i] = new Data();
+        datas[i]->value = values[i];
+        root = data_insert(root, datas[i]);
+    }
+    const uint64_t avl_insert_ns = bench_nsec() - begin;
+    const double avl_bytes = (double)(heap_bytes() - heap) / ITEMS;
+    begin = bench_nsec();
+    const uint64_t avl_sum = scan_avl(root);
+    const uint64_t avl_scan_ns = bench_nsec() - begin;
+
+    heap = heap_bytes();
+    AVLPool pool;
+    ap_init(&pool, sizeof(uint32_t));
+    begin = bench_nsec();
+    uint32_t pool_root = 0;
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        pool_root = pool_insert(&pool, pool_root, values[i]);
+    }
+    const uint64_t pool_insert_ns = bench_nsec() - begin;
+    const double pool_bytes = (double)(heap_bytes() - heap) / ITEMS;
+    begin = bench_nsec();
+    const uint64_t pool_sum = scan_pool(&pool, pool_root);
+    const uint64_t pool_scan_ns = bench_nsec() - begin;
+    if (avl_sum != pool_sum) {
+        fprintf(stderr, "the trees disagree\n");
+        exit(1);
+    }
+
+    // Every other slot is freed and refilled with a new random value.
+    for (uint32_t node = 1; node < pool.used; node += 2) {
+        pool_root = ap_del(&pool, node);
+        ap_free(&pool, node);
+    }
+    while (pool.nfree > 0) {
+        pool_root = pool_insert(&pool, pool_root, (uint32_t)rand());
+    }
+    begin = bench_nsec();
+    uint64_t check = scan_pool(&pool, pool_root);
+    const uint64_t churn_scan_ns = bench_nsec() - begin;
+    begin = bench_nsec();
+    pool_root = ap_compact(&pool, pool_root);
+    const uint64_t compact_ns = bench_nsec() - begin;
+    const double compact_bytes = (double)pool.cap * pool.stride / ITEMS;
+    begin = bench_nsec();
+    check -= scan_pool(&pool, pool_root);
+    const uint64_t compact_scan_ns = bench_nsec() - begin;
+    if (check != 0) {
+        fprintf(stderr, "ap_compact lost nodes\n");
+        exit(1);
+    }
+
+    printf("bytes/value:     avl %6.1f    pool %6.1f\n", avl_bytes, pool_bytes);
+    printf("insert ns/value: avl %6.1f    pool %6.1f\n",
+           (double)avl_insert_ns / ITEMS, (double)pool_insert_ns / ITEMS);
+    printf("scan ns/value:   avl %6.1f    pool %6.1f\n",
+           (double)avl_scan_ns / ITEMS, (double)pool_scan_ns / ITEMS);
+    printf("pool after churn: scan %.1f ns/value, ap_compact %.1f ms, then scan %.1f ns/value at %.1f bytes/value\n",
+           (double)churn_scan_ns / ITEMS, compact_ns / 1e6, (double)compact_scan_ns / ITEMS, compact_bytes);
+    ap_destroy(&pool);
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        delete datas[i];
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 2 && 0 == strcmp(argv[1], "offset")) {
+        bench_offset();
+    } else if (argc == 2 && 0 == strcmp(argv[1], "build")) {
+        bench_build();
+    } else if (argc == 2 && 0 == strcmp(argv[1], "btree")) {
+        bench_btree();
+    } else if (argc == 2 && 0 == strcmp(argv[1], "pool")) {
+        bench_pool();
+    } else {
+        fprintf(stderr, "usage: %s offset|build|btree|pool\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,601 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+
+#define LEAF_MAX    31
+#define LEAF_MIN    (LEAF_MAX / 2)
+#define INNER_MAX   18
+#define INNER_MIN   (INNER_MAX / 2)
+
+// `n` counts the items of a leaf, the children of an inner node.
+struct BNode
+{
+    uint32_t n;
+    uint32_t leaf;
+};
+
+// Leaves are chained in order for range iteration.
+struct alignas(64) BLeaf
+{
+    BNode hdr;
+    BLeaf* next;
+    double scores[LEAF_MAX];
+    void* items[LEAF_MAX];
+};
+
+// Separator i is the first item under child i + 1, so it always points at
+// a live item; counts[i] is the number of items under child i.
+struct alignas(64) BInner
+{
+    BNode hdr;
+    uint32_t counts[INNER_MAX];
+    double scores[INNER_MAX - 1];
+    void* items[INNER_MAX - 1];
+    BNode* children[INNER_MAX];
+};
+
+static_assert(sizeof(BLeaf) == BT_NODE_SIZE && sizeof(BInner) == BT_NODE_SIZE, "nodes must fill BT_NODE_SIZE");
+
+static void* node_alloc()
+{
+    void* p = aligned_alloc(64, BT_NODE_SIZE);
+    if (NULL == p) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    return p;
+}
+
+static BLeaf* leaf_new()
+{
+    BLeaf* leaf = (BLeaf*)node_alloc();
+    leaf->hdr.n = 0;
+    leaf->hdr.leaf = 1;
+    leaf->next = NULL;
+    return leaf;
+}
+
+static BInner* inner_new()
+{
+    BInner* inner = (BInner*)node_alloc();
+    inner->hdr.n = 0;
+    inner->hdr.leaf = 0;
+    return inner;
+}
+
+static inline uint32_t node_min(const BNode* node)
+{
+    return node->leaf ? LEAF_MIN : INNER_MIN;
+}
+
+static uint32_t node_count(BNode* node)
+{
+    if (node->leaf) {
+        return node->n;
+    }
+    const BInner* inner = (BInner*)node;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < inner->hdr.n; ++i) {
+        count += inner->counts[i];
+    }
+    return count;
+}
+
+// Orders the probe (score, key) against the item (item_score, item).
+static inline int probe_cmp(const BTree* tree, const double score, const void* key,
+                            const double item_score, const void* item)
+{
+    if (score != item_score) {
+        return score < item_score ? -1 : 1;
+    }
+    return -tree->cmp(item, key);
+}
+
+// First position whose item is not ordered before the probe.
+static uint32_t leaf_lower_bound(const BTree* tree, const BLeaf* leaf, const double score, const void* key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = leaf->hdr.n;
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        if (probe_cmp(tree, score, key, leaf->scores[mid], leaf->items[mid]) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// The child whose range holds the probe: the number of separators <= it.
+static uint32_t inner_child(const BTree* tree, const BInner* inner, const double score, const void* key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = inner->hdr.n - 1;
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        if (probe_cmp(tree, score, key, inner->scores[mid], inner->items[mid]) >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void leaf_insert_at(BLeaf* leaf, const uint32_t pos, const double score, void* item)
+{
+    const uint32_t tail = leaf->hdr.n - pos;
+    memmove(&leaf->scores[pos + 1], &leaf->scores[pos], tail * sizeof(double));
+    memmove(&leaf->items[pos + 1], &leaf->items[pos], tail * sizeof(void *));
+    leaf->scores[pos] = score;
+    leaf->items[pos] = item;
+    ++leaf->hdr.n;
+}
+
+static void leaf_remove_at(BLeaf* leaf, const uint32_t pos)
+{
+    const uint32_t tail = leaf->hdr.n - pos - 1;
+    memmove(&leaf->scores[pos], &leaf->scores[pos + 1], tail * sizeof(double));
+    memmove(&leaf->items[pos], &leaf->items[pos + 1], tail * sizeof(void *));
+    --leaf->hdr.n;
+}
+
+// Puts `child` at index c >= 1, with the separator in front of it.
+static void inner_insert_at(BInner* inner, const uint32_t c, BNode* child, const uint32_t count,
+                            const double score, void* item)
+{
+    assert(c >= 1);
+    const uint32_t tail = inner->hdr.n - c;
+    memmove(&inner->children[c + 1], &inner->children[c], tail * sizeof(BNode *));
+    memmove(&inner->counts[c + 1], &inner->counts[c], tail * sizeof(uint32_t));
+    memmove(&inner->scores[c], &inner->scores[c - 1], tail * sizeof(double));
+    memmove(&inner->items[c], &inner->items[c - 1], tail * sizeof(void *));
+    inner->children[c] = child;
+    inner->counts[c] = count;
+    inner->scores[c - 1] = score;
+    inner->items[c - 1] = item;
+    ++inner->hdr.n;
+}
+
+// Drops the child at index c >= 1 and the separator in front of it.
+static void inner_remove_at(BInner* inner, const uint32_t c)
+{
+    assert(c >= 1);
+    const uint32_t tail = inner->hdr.n - c - 1;
+    memmove(&inner->children[c], &inner->children[c + 1], tail * sizeof(BNode *));
+    memmove(&inner->counts[c], &inner->counts[c + 1], tail * sizeof(uint32_t));
+    memmove(&inner->scores[c - 1], &inner->scores[c], tail * sizeof(double));
+    memmove(&inner->items[c - 1], &inner->items[c], tail * sizeof(void *));
+    --inner->hdr.n;
+}
+
+void bt_init(BTree* tree, int (*cmp)(const void* item, const void* key))
+{
+    tree->root = NULL;
+    tree->size = 0;
+    tree->cmp = cmp;
+}
+
+/*
+ * Inserts below `node`. A full node splits in two halves; the new right
+ * half is returned, with its first item in *sep_score and *sep_item, for
+ * the parent to add as a child. A new item never becomes the first of any
+ * child but the leftmost, so existing separators stay valid.
+ */
+static BNode* insert_rec(BTree* tree, BNode* node, const double score, const void* key, void* item,
+                         double* sep_score, void** sep_item)
+{
+    if (node->leaf) {
+        BLeaf* leaf = (BLeaf*)node;
+        const uint32_t pos = leaf_lower_bound(tree, leaf, score, key);
+        if (leaf->hdr.n < LEAF_MAX) {
+            leaf_insert_at(leaf, pos, score, item);
+            return NULL;
+        }
+        BLeaf* right = leaf_new();
+        const uint32_t half = LEAF_MAX / 2;
+        right->hdr.n = LEAF_MAX - half;
+        memcpy(right->scores, &leaf->scores[half], right->hdr.n * sizeof(double));
+        memcpy(right->items, &leaf->items[half], right->hdr.n * sizeof(void *));
+        leaf->hdr.n = half;
+        right->next = leaf->next;
+        leaf->next = right;
+        if (pos <= half) {
+            leaf_insert_at(leaf, pos, score, item);
+        } else {
+            leaf_insert_at(right, pos - half, score, item);
+        }
+        *sep_score = right->scores[0];
+        *sep_item = right->items[0];
+        return &right->hdr;
+    }
+
+    BInner* inner = (BInner*)node;
+    const uint32_t i = inner_child(tree, inner, score, key);
+    ++inner->counts[i];
+    double split_score = 0;
+    void* split_item = NULL;
+    BNode* split = insert_rec(tree, inner->children[i], score, key, item, &split_score, &split_item);
+    if (NULL == split) {
+        return NULL;
+    }
+    inner->counts[i] = node_count(inner->children[i]);
+    const uint32_t split_count = node_count(split);
+    if (inner->hdr.n < INNER_MAX) {
+        inner_insert_at(inner, i + 1, split, split_count, split_score, split_item);
+        return NULL;
+    }
+
+    // Children [half, MAX) move right; the separator between the halves
+    // moves up instead.
+    BInner* right = inner_new();
+    const uint32_t half = INNER_MAX / 2;
+    right->hdr.n = INNER_MAX - half;
+    memcpy(right->children, &inner->children[half], right->hdr.n * sizeof(BNode *));
+    memcpy(right->counts, &inner->counts[half], right->hdr.n * sizeof(uint32_t));
+    memcpy(right->scores, &inner->scores[half], (right->hdr.n - 1) * sizeof(double));
+    memcpy(right->items, &inner->items[half], (right->hdr.n - 1) * sizeof(void *));
+    *sep_score = inner->scores[half - 1];
+    *sep_item = inner->items[half - 1];
+    inner->hdr.n = half;
+    if (i + 1 <= half) {
+        inner_insert_at(inner, i + 1, split, split_count, split_score, split_item);
+    } else {
+        inner_insert_at(right, i + 1 - half, split, split_count, split_score, split_item);
+    }
+    return &right->hdr;
+}
+
+void bt_insert(BTree* tree, const double score, const void* key, void* item)
+{
+    if (NULL == tree->root) {
+        tree->root = &leaf_new()->hdr;
+    }
+    double sep_score = 0;
+    void* sep_item = NULL;
+    BNode* split = insert_rec(tree, tree->root, score, key, item, &sep_score, &sep_item);
+    if (split != NULL) {
+        BInner* root = inner_new();
+        root->hdr.n = 2;
+        root->children[0] = tree->root;
+        root->children[1] = split;
+        root->counts[0] = node_count(tree->root);
+        root->counts[1] = node_count(split);
+        root->scores[0] = sep_score;
+        root->items[0] = sep_item;
+        tree->root = &root->hdr;
+    }
+    ++tree->size;
+}
+
+static BLeaf* first_leaf(BNode* node)
+{
+    while (!node->leaf) {
+        node = ((BInner*)node)->children[0];
+    }
+    return (BLeaf*)node;
+}
+
+// Child i + 1 is appended to child i and freed.
+static void merge_children(BInner* inner, const uint32_t i)
+{
+    BNode* left = inner->children[i];
+    BNode* right = inner->children[i + 1];
+    if (left->leaf) {
+        BLeaf* l = (BLeaf*)left;
+        BLeaf* r = (BLeaf*)right;
+        memcpy(&l->scores[l->hdr.n], r->scores, r->hdr.n * sizeof(double));
+        memcpy(&l->items[l->hdr.n], r->items, r->hdr.n * sizeof(void *));
+        l->hdr.n += r->hdr.n;
+        l->next = r->next;
+    } else {
+        BInner* l = (BInner*)left;
+        BInner* r = (BInner*)right;
+        l->scores[l->hdr.n - 1] = inner->scores[i];
+        l->items[l->hdr.n - 1] = inner->items[i];
+        memcpy(&l->children[l->hdr.n], r->children, r->hdr.n * sizeof(BNode *));
+        memcpy(&l->counts[l->hdr.n], r->counts, r->hdr.n * sizeof(uint32_t));
+        memcpy(&l->scores[l->hdr.n], r->scores, (r->hdr.n - 1) * sizeof(double));
+        memcpy(&l->items[l->hdr.n], r->items, (r->hdr.n - 1) * sizeof(void *));
+        l->hdr.n += r->hdr.n;
+    }
+    inner->counts[i] += inner->counts[i + 1];
+    inner_remove_at(inner, i + 1);
+    free(right);
+}
+
+// Moves the last entry of child i - 1 to the front of child i.
+static void borrow_from_left(BInner* inner, const uint32_t i)
+{
+    BNode* node = inner->children[i];
+    uint32_t moved = 1;
+    if (node->leaf) {
+        BLeaf* l = (BLeaf*)inner->children[i - 1];
+        BLeaf* child = (BLeaf*)node;
+        const uint32_t last = --l->hdr.n;
+        leaf_insert_at(child, 0, l->scores[last], l->items[last]);
+        inner->scores[i - 1] = child->scores[0];
+        inner->items[i - 1] = child->items[0];
+    } else {
+        BInner* l = (BInner*)inner->children[i - 1];
+        BInner* child = (BInner*)node;
+        const uint32_t last = --l->hdr.n;
+        moved = l->counts[last];
+        // The old first child takes the old separator as its own.
+        const uint32_t n = child->hdr.n;
+        memmove(&child->children[1], child->children, n * sizeof(BNode *));
+        memmove(&child->counts[1], child->counts, n * sizeof(uint32_t));
+        memmove(&child->scores[1], child->scores, (n - 1) * sizeof(double));
+        memmove(&child->items[1], child->items, (n - 1) * sizeof(void *));
+        child->children[0] = l->children[last];
+        child->counts[0] = moved;
+        child->scores[0] = inner->scores[i - 1];
+        child->items[0] = inner->items[i - 1];
+        ++child->hdr.n;
+        inner->scores[i - 1] = l->scores[last - 1];
+        inner->items[i - 1] = l->items[last - 1];
+    }
+    inner->counts[i - 1] -= moved;
+    inner->counts[i] += moved;
+}
+
+// Moves the first entry of child i + 1 to the back of child i.
+static void borrow_from_right(BInner* inner, const uint32_t i)
+{
+    BNode* node = inner->children[i];
+    uint32_t moved = 1;
+    if (node->leaf) {
+        BLeaf* r = (BLeaf*)inner->children[i + 1];
+        BLeaf* child = (BLeaf*)node;
+        leaf_insert_at(child, child->hdr.n, r->scores[0], r->items[0]);
+        leaf_remove_at(r, 0);
+        inner->scores[i] = r->scores[0];
+        inner->items[i] = r->items[0];
+    } else {
+        BInner* r = (BInner*)inner->children[i + 1];
+        BInner* child = (BInner*)node;
+        moved = r->counts[0];
+        const uint32_t n = child->hdr.n;
+        child->children[n] = r->children[0];
+        child->counts[n] = moved;
+        child->scores[n - 1] = inner->scores[i];
+        child->items[n - 1] = inner->items[i];
+        ++child->hdr.n;
+        inner->scores[i] = r->scores[0];
+        inner->items[i] = r->items[0];
+        const uint32_t rn = --r->hdr.n;
+        memmove(r->children, &r->children[1], rn * sizeof(BNode *));
+        memmove(r->counts, &r->counts[1], rn * sizeof(uint32_t));
+        memmove(r->scores, &r->scores[1], (rn - 1) * sizeof(double));
+        memmove(r->items, &r->items[1], (rn - 1) * sizeof(void *));
+    }
+    inner->counts[i] += moved;
+    inner->counts[i + 1] -= moved;
+}
+
+/*
+ * Removes the item equal to the probe from below `node`, and sets *first
+ * if it was the first item there. A child left under half full borrows
+ * from its left sibling, or its right one for the first child, or merges
+ * with it if that sibling has none to spare.
+ * The removed item was also the separator of the lowest ancestor reached
+ * through a child other than the first. That ancestor points the separator
+ * at the child's new first item before rebalancing, which may move it.
+ */
+static void* delete_rec(BTree* tree, BNode* node, const double score, const void* key, bool* first)
+{
+    if (node->leaf) {
+        BLeaf* leaf = (BLeaf*)node;
+        const uint32_t pos = leaf_lower_bound(tree, leaf, score, key);
+        if (pos == leaf->hdr.n || probe_cmp(tree, score, key, leaf->scores[pos], leaf->items[pos]) != 0) {
+            return NULL;
+        }
+        void* item = leaf->items[pos];
+        leaf_remove_at(leaf, pos);
+        *first = pos == 0;
+        return item;
+    }
+
+    BInner* inner = (BInner*)node;
+    const uint32_t i = inner_child(tree, inner, score, key);
+    bool child_first = false;
+    void* item = delete_rec(tree, inner->children[i], score, key, &child_first);
+    if (NULL == item) {
+        return NULL;
+    }
+    --inner->counts[i];
+    *first = i == 0 && child_first;
+
+    BNode* child = inner->children[i];
+    if (i > 0 && child_first) {
+        const BLeaf* leaf = first_leaf(child);
+        inner->scores[i - 1] = leaf->scores[0];
+        inner->items[i - 1] = leaf->items[0];
+    }
+    if (child->n >= node_min(child)) {
+        return item;
+    }
+    if (i > 0) {
+        if (inner->children[i - 1]->n > node_min(child)) {
+            borrow_from_left(inner, i);
+        } else {
+            merge_children(inner, i - 1);
+        }
+    } else {
+        if (inner->children[1]->n > node_min(child)) {
+            borrow_from_right(inner, 0);
+        } else {
+            merge_children(inner, 0);
+        }
+    }
+    return item;
+}
+
+void* bt_delete(BTree* tree, const double score, const void* key)
+{
+    if (NULL == tree->root) {
+        return NULL;
+    }
+    bool first = false;
+    void* item = delete_rec(tree, tree->root, score, key, &first);
+    if (NULL == item) {
+        return NULL;
+    }
+    --tree->size;
+    BNode* root = tree->root;
+    if (root->leaf && root->n == 0) {
+        free(root);
+        tree->root = NULL;
+    } else if (!root->leaf && root->n == 1) {
+        tree->root = ((BInner*)root)->children[0];
+        free(root);
+    }
+    return item;
+}
+
+// Descends towards the probe, counting the items passed on the way.
+static BLeaf* descend(BTree* tree, const double score, const void* key, uint64_t* rank)
+{
+    BNode* node = tree->root;
+    *rank = 0;
+    while (!node->leaf) {
+        const BInner* inner = (BInner*)node;
+        const uint32_t i = inner_child(tree, inner, score, key);
+        for (uint32_t j = 0; j < i; ++j) {
+            *rank += inner->counts[j];
+        }
+        node = inner->children[i];
+    }
+    return (BLeaf*)node;
+}
+
+int64_t bt_rank(BTree* tree, const double score, const void* key)
+{
+    if (NULL == tree->root) {
+        return -1;
+    }
+    uint64_t rank = 0;
+    const BLeaf* leaf = descend(tree, score, key, &rank);
+    const uint32_t pos = leaf_lower_bound(tree, leaf, score, key);
+    if (pos == leaf->hdr.n || probe_cmp(tree, score, key, leaf->scores[pos], leaf->items[pos]) != 0) {
+        return -1;
+    }
+    return (int64_t)(rank + pos);
+}
+
+bool bt_at(BTree* tree, const uint64_t rank, BIter* it)
+{
+    if (rank >= tree->size) {
+        return false;
+    }
+    BNode* node = tree->root;
+    uint64_t left = rank;
+    while (!node->leaf) {
+        const BInner* inner = (BInner*)node;
+        uint32_t i = 0;
+        while (left >= inner->counts[i]) {
+            left -= inner->counts[i++];
+        }
+        node = inner->children[i];
+    }
+    it->leaf = (BLeaf*)node;
+    it->pos = (uint32_t)left;
+    it->rank = rank;
+    return true;
+}
+
+bool bt_seekge(BTree* tree, const double score, const void* key, BIter* it)
+{
+    if (NULL == tree->root) {
+        return false;
+    }
+    uint64_t rank = 0;
+    BLeaf* leaf = descend(tree, score, key, &rank);
+    uint32_t pos = leaf_lower_bound(tree, leaf, score, key);
+    rank += pos;
+    if (pos == leaf->hdr.n) {
+        // Then the next leaf starts with the first item after the probe.
+        leaf = leaf->next;
+        pos = 0;
+        if (NULL == leaf) {
+            return false;
+        }
+    }
+    it->leaf = leaf;
+    it->pos = pos;
+    it->rank = rank;
+    return true;
+}
+
+bool bt_offset(BTree* tree, BIter* it, const int64_t offset)
+{
+    const int64_t pos = (int64_t)it->pos + offset;
+    if (pos >= 0 && pos < (int64_t)it->leaf->hdr.n) {
+        it->pos = (uint32_t)pos;
+        it->rank += offset;
+        return true;
+    }
+    const int64_t rank = (int64_t)it->rank + offset;
+    return rank >= 0 && bt_at(tree, (uint64_t)rank, it);
+}
+
+bool bt_next(BIter* it)
+{
+    ++it->rank;
+    if (++it->pos == it->leaf->hdr.n) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+}
+
+void* bt_item(const BIter* it)
+{
+    return it->leaf->items[it->pos];
+}
+
+double bt_score(const BIter* it)
+{
+    return it->leaf->scores[it->pos];
+}
+
+static void node_free(BNode* node)
+{
+    if (!node->leaf) {
+        BInner* inner = (BInner*)node;
+        for (uint32_t i = 0; i < inner->hdr.n; ++i) {
+            node_free(inner->children[i]);
+        }
+    }
+    free(node);
+}
+
+void bt_destroy(BTree* tree)
+{
+    if (tree->root != NULL) {
+        node_free(tree->root);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+static size_t node_bytes(const BNode* node)
+{
+    size_t bytes = BT_NODE_SIZE;
+    if (!node->leaf) {
+        const BInner* inner = (const BInner*)node;
+        for (uint32_t i = 0; i < inner->hdr.n; ++i) {
+            bytes += node_bytes(inner->children[i]);
+        }
+    }
+    return bytes;
+}
+
+size_t bt_bytes(BTree* tree)
+{
+    return tree->root != NULL ? node_bytes(tree->root) : 0;
+}
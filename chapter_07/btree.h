@@ -0,0 +1,59 @@
+#ifndef __BTREE_H__
+#define __BTREE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * B+tree of items ordered by a double score, ties broken by a callback.
+ * Nodes are 512 bytes and cache-line aligned. Leaves keep the scores apart
+ * from the item pointers, so a search reads a few lines per level and calls
+ * the callback only on equal scores. Inner nodes count the items under each
+ * child, which gives ranks and positions in O(log n), like the AVL tree.
+ * Items are not owned by the tree.
+ */
+#define BT_NODE_SIZE    512
+
+struct BNode;
+struct BLeaf;
+
+struct BTree
+{
+    BNode* root;
+    size_t size;
+    // Orders `item` against the probe `key`: <0, 0 or >0 like memcmp.
+    int (*cmp)(const void* item, const void* key);
+};
+
+// A position in the tree; `rank` is the position counted from 0.
+struct BIter
+{
+    BLeaf* leaf;
+    uint32_t pos;
+    uint64_t rank;
+};
+
+void bt_init(BTree* tree, int (*cmp)(const void* item, const void* key));
+// `key` is the probe that orders equal to `item`; no equal item may be in
+// the tree already.
+void bt_insert(BTree* tree, double score, const void* key, void* item);
+// Returns the item removed, NULL if there is none.
+void* bt_delete(BTree* tree, double score, const void* key);
+// Position of the item ordering equal to (score, key); -1 if there is none.
+int64_t bt_rank(BTree* tree, double score, const void* key);
+// Point `it` at the item at `rank`; false past the end.
+bool bt_at(BTree* tree, uint64_t rank, BIter* it);
+// Point `it` at the first item not ordered before (score, key); false if none.
+bool bt_seekge(BTree* tree, double score, const void* key, BIter* it);
+// Moves `it` by `offset` items either way; false if that leaves the tree.
+bool bt_offset(BTree* tree, BIter* it, int64_t offset);
+// Steps to the next item; false after the last one.
+bool bt_next(BIter* it);
+void* bt_item(const BIter* it);
+double bt_score(const BIter* it);
+// Frees the nodes, not the items.
+void bt_destroy(BTree* tree);
+// Bytes of all nodes.
+size_t bt_bytes(BTree* tree);
+
+#endif // __BTREE_H__
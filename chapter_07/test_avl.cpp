@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <set>
+#include <vector>
 #include <algorithm>
 
 #include "avl.h"
@@ -117,7 +118,7 @@ static inline void dispose(Container& container)
 static inline void test_insert(const uint32_t size)
 {
     for (uint32_t value = 0; value < size; ++value) {
-        Container container;
+        Container container = {NULL};
         std::multiset<uint32_t> ref;
         for (uint32_t i = 0; i < size; ++i) {
             if (i == value) {
@@ -138,7 +139,7 @@ static inline void test_insert(const uint32_t size)
 static inline void test_insert_dup(const uint32_t size)
 {
     for (uint32_t value = 0; value < size; ++value) {
-        Container container;
+        Container container = {NULL};
         std::multiset<uint32_t> ref;
         for (uint32_t i = 0; i < size; ++i) {
             add(container, i);
@@ -156,7 +157,7 @@ static inline void test_insert_dup(const uint32_t size)
 static inline void test_remove(const uint32_t size)
 {
     for (uint32_t value = 0; value < size; ++value) {
-        Container container;
+        Container container = {NULL};
         std::multiset<uint32_t> ref;
         for (uint32_t i = 0; i < size; ++i) {
             add(container, i);
@@ -171,6 +172,81 @@ static inline void test_remove(const uint32_t size)
     }
 }
 
+static inline uint32_t node_value(AVLNode* node)
+{
+    return CONTAINER_OF(node, struct Data, node)->value;
+}
+
+// Every node reaches every other by offset, and nothing past either end.
+static inline void test_offset(const uint32_t size)
+{
+    Container container = {NULL};
+    for (uint32_t i = 0; i < size; ++i) {
+        add(container, i);
+    }
+    AVLNode* min = container.root;
+    while (min != NULL && min->left != NULL) {
+        min = min->left;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        AVLNode* node = avl_offset(min, (int64_t)i);
+        assert(node != NULL && node_value(node) == i);
+        assert(avl_rank(node) == (int64_t)i);
+        for (uint32_t j = 0; j < size; ++j) {
+            AVLNode* other = avl_offset(node, (int64_t)j - (int64_t)i);
+            assert(other != NULL && node_value(other) == j);
+        }
+        assert(avl_offset(node, -(int64_t)i - 1) == NULL);
+        assert(avl_offset(node, (int64_t)(size - i)) == NULL);
+    }
+    dispose(container);
+}
+
+static inline void test_build(const uint32_t size)
+{
+    std::vector<Data> data(size);
+    std::vector<AVLNode*> nodes(size);
+    std::multiset<uint32_t> ref;
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i].value = i / 2;
+        nodes[i] = &data[i].node;
+        ref.insert(i / 2);
+    }
+    Container container = {avl_build(nodes.data(), size)};
+    container_verify(container, ref);
+    // As shallow as a tree of `size` nodes can be.
+    uint32_t depth = 0;
+    while ((1u << depth) <= size) {
+        ++depth;
+    }
+    assert(avl_depth(container.root) == depth);
+}
+
+static bool less(AVLNode* lhs, AVLNode* rhs)
+{
+    return node_value(lhs) < node_value(rhs);
+}
+
+static inline void test_merge(const uint32_t lhs_size, const uint32_t rhs_size)
+{
+    Container lhs = {NULL};
+    Container rhs = {NULL};
+    std::multiset<uint32_t> ref;
+    for (uint32_t i = 0; i < lhs_size; ++i) {
+        const uint32_t value = (uint32_t)rand() % 100;
+        add(lhs, value);
+        ref.insert(value);
+    }
+    for (uint32_t i = 0; i < rhs_size; ++i) {
+        const uint32_t value = (uint32_t)rand() % 100;
+        add(rhs, value);
+        ref.insert(value);
+    }
+    Container merged = {avl_merge(lhs.root, rhs.root, &less)};
+    container_verify(merged, ref);
+    dispose(merged);
+}
+
 int main()
 {
     Container container = {NULL};
@@ -218,6 +294,16 @@ int main()
         test_insert(i);
         test_insert_dup(i);
         test_remove(i);
+        test_offset(i);
+    }
+
+    for (uint32_t i = 0; i < 300; ++i) {
+        test_build(i);
+    }
+    for (uint32_t i = 0; i < 40; ++i) {
+        for (uint32_t j = 0; j < 40; ++j) {
+            test_merge(i, j);
+        }
     }
 
 
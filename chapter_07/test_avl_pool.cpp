@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+
+#include "avl_pool.h"
+
+struct Container
+{
+    AVLPool pool;
+    uint32_t root;
+};
+
+static inline uint32_t node_value(Container& c, const uint32_t node)
+{
+    return *(uint32_t*)ap_data(&c.pool, node);
+}
+
+static void add(Container& c, const uint32_t value)
+{
+    const uint32_t node = ap_alloc(&c.pool);
+    *(uint32_t*)ap_data(&c.pool, node) = value;
+
+    uint32_t current = 0;
+    uint32_t* from = &c.root;
+    while (*from) {
+        current = *from;
+        APNode* n = ap_node(&c.pool, current);
+        from = value < node_value(c, current) ? &n->left : &n->right;
+    }
+    *from = node;
+    ap_node(&c.pool, node)->parent = current;
+    c.root = ap_fix(&c.pool, node);
+}
+
+static bool del(Container& c, const uint32_t value)
+{
+    uint32_t current = c.root;
+    while (current) {
+        const uint32_t v = node_value(c, current);
+        if (value == v) {
+            break;
+        }
+        current = value < v ? ap_node(&c.pool, current)->left : ap_node(&c.pool, current)->right;
+    }
+    if (!current) {
+        return false;
+    }
+    c.root = ap_del(&c.pool, current);
+    ap_free(&c.pool, current);
+    return true;
+}
+
+static void verify_node(Container& c, const uint32_t parent, const uint32_t node)
+{
+    if (!node) {
+        return;
+    }
+    const APNode* n = ap_node(&c.pool, node);
+    assert(n->parent == parent);
+    verify_node(c, node, n->left);
+    verify_node(c, node, n->right);
+    assert(n->value == 1 + ap_value(&c.pool, n->left) + ap_value(&c.pool, n->right));
+    const uint32_t l = ap_depth(&c.pool, n->left);
+    const uint32_t r = ap_depth(&c.pool, n->right);
+    assert(l == r || l + 1 == r || l == r + 1);
+    assert(n->depth == 1 + (l < r ? r : l));
+    if (n->left) {
+        assert(node_value(c, n->left) <= node_value(c, node));
+    }
+    if (n->right) {
+        assert(node_value(c, n->right) >= node_value(c, node));
+    }
+}
+
+static void extract(Container& c, const uint32_t node, std::vector<uint32_t>& out)
+{
+    if (!node) {
+        return;
+    }
+    extract(c, ap_node(&c.pool, node)->left, out);
+    out.push_back(node_value(c, node));
+    extract(c, ap_node(&c.pool, node)->right, out);
+}
+
+static void verify(Container& c, const std::multiset<uint32_t>& ref)
+{
+    verify_node(c, 0, c.root);
+    assert(ap_value(&c.pool, c.root) == ref.size());
+    assert(ap_live(&c.pool) == ref.size());
+    std::vector<uint32_t> extracted;
+    extract(c, c.root, extracted);
+    std::vector<uint32_t> expected(ref.begin(), ref.end());
+    assert(extracted == expected);
+}
+
+// Every node reaches every other by offset, and knows its rank.
+static void verify_offset(Container& c)
+{
+    const uint32_t n = ap_value(&c.pool, c.root);
+    uint32_t first = c.root;
+    while (first && ap_node(&c.pool, first)->left) {
+        first = ap_node(&c.pool, first)->left;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t node = ap_offset(&c.pool, first, i);
+        assert(node && ap_rank(&c.pool, node) == i);
+        for (uint32_t j = 0; j < n; ++j) {
+            const uint32_t other = ap_offset(&c.pool, node, (int64_t)j - (int64_t)i);
+            assert(other && ap_rank(&c.pool, other) == j);
+        }
+        assert(ap_offset(&c.pool, node, -(int64_t)i - 1) == 0);
+        assert(ap_offset(&c.pool, node, (int64_t)(n - i)) == 0);
+    }
+}
+
+static void test_random(const uint32_t ops, const uint32_t range)
+{
+    Container c;
+    ap_init(&c.pool, sizeof(uint32_t));
+    c.root = 0;
+    std::multiset<uint32_t> ref;
+    for (uint32_t op = 0; op < ops; ++op) {
+        const uint32_t value = (uint32_t)rand() % range;
+        if (rand() % 3 == 0) {
+            std::multiset<uint32_t>::iterator it = ref.find(value);
+            assert(del(c, value) == (it != ref.end()));
+            if (it != ref.end()) {
+                ref.erase(it);
+            }
+        } else {
+            add(c, value);
+            ref.insert(value);
+        }
+        if (op % (ref.size() / 16 + 97) == 0) {
+            verify(c, ref);
+        }
+        if (op % 4096 == 4095) {
+            c.root = ap_compact(&c.pool, c.root);
+            verify(c, ref);
+            // Packed in order into slots 1..n.
+            assert(c.pool.used == ref.size() + 1 && c.pool.nfree == 0);
+            uint32_t i = 1;
+            for (std::multiset<uint32_t>::const_iterator it = ref.begin(); it != ref.end(); ++it, ++i) {
+                assert(node_value(c, i) == *it);
+            }
+        }
+    }
+    verify(c, ref);
+    ap_destroy(&c.pool);
+}
+
+static void test_offset()
+{
+    for (uint32_t n = 0; n < 100; ++n) {
+        Container c;
+        ap_init(&c.pool, sizeof(uint32_t));
+        c.root = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            add(c, (uint32_t)rand() % 50);
+        }
+        verify_offset(c);
+        c.root = ap_compact(&c.pool, c.root);
+        verify_offset(c);
+        ap_destroy(&c.pool);
+    }
+}
+
+// Freed slots are handed out again before the array grows.
+static void test_reuse()
+{
+    Container c;
+    ap_init(&c.pool, sizeof(uint32_t));
+    c.root = 0;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        add(c, i);
+    }
+    const uint32_t used = c.pool.used;
+    for (uint32_t i = 0; i < 1000; i += 2) {
+        assert(del(c, i));
+    }
+    for (uint32_t i = 0; i < 500; ++i) {
+        add(c, 1000 + i);
+    }
+    assert(c.pool.used == used && c.pool.nfree == 0);
+    c.root = ap_compact(&c.pool, c.root);
+    assert(c.pool.cap == 1001);
+    ap_destroy(&c.pool);
+}
+
+int main()
+{
+    test_offset();
+    test_reuse();
+    test_random(20000, 1000);
+    test_random(20000, 10);
+    test_random(100000, 1 << 30);
+    return 0;
+}
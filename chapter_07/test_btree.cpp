@@ -0,0 +1,176 @@
+// Built on its own, so the checks can see the node layout:
+//   g++ -O2 test_btree.cpp -o test_btree
+#include "btree.cpp"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+struct Data
+{
+    double score;
+    uint32_t id;
+};
+
+typedef std::set<std::pair<double, uint32_t> > Ref;
+
+static int cmp(const void* item, const void* key)
+{
+    const uint32_t lhs = ((const Data*)item)->id;
+    const uint32_t rhs = ((const Data*)key)->id;
+    return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+
+static inline bool data_less(const Data* lhs, const Data* rhs)
+{
+    return lhs->score < rhs->score || (lhs->score == rhs->score && lhs->id < rhs->id);
+}
+
+// Checks the subtree and returns its item count. Every leaf is at `depth`;
+// *first gets the subtree's first item.
+static uint32_t node_verify(BNode* node, const bool root, const uint32_t depth, Data** first,
+                            std::vector<BLeaf*>& leaves)
+{
+    assert(root || node->n >= node_min(node));
+    if (node->leaf) {
+        assert(depth == 0);
+        BLeaf* leaf = (BLeaf*)node;
+        assert(leaf->hdr.n >= 1 && leaf->hdr.n <= LEAF_MAX);
+        for (uint32_t i = 0; i < leaf->hdr.n; ++i) {
+            assert(((Data*)leaf->items[i])->score == leaf->scores[i]);
+            if (i > 0) {
+                assert(data_less((Data*)leaf->items[i - 1], (Data*)leaf->items[i]));
+            }
+        }
+        *first = (Data*)leaf->items[0];
+        leaves.push_back(leaf);
+        return leaf->hdr.n;
+    }
+    BInner* inner = (BInner*)node;
+    assert(inner->hdr.n >= 2 && inner->hdr.n <= INNER_MAX);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < inner->hdr.n; ++i) {
+        Data* child_first = NULL;
+        const uint32_t n = node_verify(inner->children[i], false, depth - 1, &child_first, leaves);
+        assert(n == inner->counts[i]);
+        count += n;
+        if (i == 0) {
+            *first = child_first;
+        } else {
+            // Separators point at the first item under their child.
+            assert(inner->items[i - 1] == child_first && inner->scores[i - 1] == child_first->score);
+        }
+    }
+    return count;
+}
+
+static void tree_verify(BTree* tree, const Ref& ref)
+{
+    assert(tree->size == ref.size());
+    if (tree->root == NULL) {
+        assert(ref.empty());
+        return;
+    }
+    uint32_t depth = 0;
+    for (BNode* node = tree->root; !node->leaf; node = ((BInner*)node)->children[0]) {
+        ++depth;
+    }
+    Data* first = NULL;
+    std::vector<BLeaf*> leaves;
+    assert(node_verify(tree->root, true, depth, &first, leaves) == ref.size());
+    for (size_t i = 0; i + 1 < leaves.size(); ++i) {
+        assert(leaves[i]->next == leaves[i + 1]);
+    }
+    assert(leaves.back()->next == NULL);
+
+    // In order, by iteration and by rank.
+    BIter it;
+    uint64_t rank = 0;
+    bool more = bt_at(tree, 0, &it);
+    for (Ref::const_iterator r = ref.begin(); r != ref.end(); ++r, ++rank) {
+        assert(more && it.rank == rank);
+        const Data* data = (const Data*)bt_item(&it);
+        assert(data->score == r->first && data->id == r->second && bt_score(&it) == r->first);
+        assert(bt_rank(tree, data->score, data) == (int64_t)rank);
+        more = bt_next(&it);
+    }
+    assert(!more && !bt_at(tree, ref.size(), &it));
+}
+
+static void test_random(const uint32_t n, const uint32_t ops, const uint32_t scores)
+{
+    std::vector<Data> data(n);
+    std::vector<bool> present(n, false);
+    BTree tree;
+    bt_init(&tree, &cmp);
+    Ref ref;
+    for (uint32_t op = 0; op < ops; ++op) {
+        const uint32_t id = (uint32_t)rand() % n;
+        Data* d = &data[id];
+        if (!present[id]) {
+            d->score = (double)(rand() % scores);
+            d->id = id;
+            bt_insert(&tree, d->score, d, d);
+            ref.insert(std::make_pair(d->score, id));
+            present[id] = true;
+        } else {
+            assert(bt_delete(&tree, d->score, d) == d);
+            assert(bt_delete(&tree, d->score, d) == NULL);
+            ref.erase(std::make_pair(d->score, id));
+            present[id] = false;
+        }
+        if (op % (n / 16 + 7) == 0) {
+            tree_verify(&tree, ref);
+        }
+    }
+    tree_verify(&tree, ref);
+
+    // Seeks from probes that are and are not in the tree, then offsets.
+    for (uint32_t i = 0; i < 200 && !ref.empty(); ++i) {
+        Data probe;
+        probe.score = (double)(rand() % (scores + 2)) - 1;
+        probe.id = (uint32_t)rand() % (n + 1);
+        Ref::const_iterator r = ref.lower_bound(std::make_pair(probe.score, probe.id));
+        BIter it;
+        const bool found = bt_seekge(&tree, probe.score, &probe, &it);
+        assert(found == (r != ref.end()));
+        if (!found) {
+            continue;
+        }
+        assert(((Data*)bt_item(&it))->id == r->second);
+        const int64_t rank = (int64_t)it.rank;
+        const int64_t offset = (int64_t)(rand() % (2 * ref.size() + 2)) - (int64_t)ref.size() - 1;
+        if (bt_offset(&tree, &it, offset)) {
+            assert(rank + offset >= 0 && rank + offset < (int64_t)ref.size());
+            BIter at;
+            assert(bt_at(&tree, (uint64_t)(rank + offset), &at) && bt_item(&at) == bt_item(&it));
+            assert(it.rank == (uint64_t)(rank + offset));
+        } else {
+            assert(rank + offset < 0 || rank + offset >= (int64_t)ref.size());
+        }
+    }
+
+    // Drain in random order.
+    for (uint32_t id = 0; id < n; ++id) {
+        const uint32_t pick = (id * 7919) % n;
+        if (present[pick]) {
+            assert(bt_delete(&tree, data[pick].score, &data[pick]) == &data[pick]);
+            ref.erase(std::make_pair(data[pick].score, pick));
+        }
+    }
+    tree_verify(&tree, ref);
+    assert(tree.root == NULL);
+    bt_destroy(&tree);
+}
+
+int main()
+{
+    for (uint32_t n = 1; n < 100; ++n) {
+        test_random(n, 4 * n, 1000);
+    }
+    // Deep trees; few scores make the tie-breaks do the work.
+    test_random(20000, 100000, 1 << 30);
+    test_random(20000, 100000, 3);
+    test_random(100000, 300000, 1000);
+    return 0;
+}